@@ -3,60 +3,171 @@
 #include <SmartNetwork/Websockets.hpp>
 #include <SmartNetwork/Commands.hpp>
 #include <SmartNetwork/Relations.hpp>
+#include <SmartNetwork/Snapshot.hpp>
 #include <fstream>
-#include <cereal/archives/binary.hpp>
-#include <cereal/types/string.hpp>
 #include <filesystem>
 
 int main() {
     Capabilities capabilities;
     DeviceMap map(&capabilities);
     Relations relations(&map, &capabilities);
+    std::unique_ptr<impl::ColdStore> coldStore;
+    std::unique_ptr<Journal> journal;
 
-    auto save = [&]() {
-        std::ofstream os("data.cereal", std::ios::binary);
-        cereal::BinaryOutputArchive oarchive(os);
-        oarchive(capabilities, map, relations);
-        std::cout << "Saving data..." << std::endl;
-    };
+    Snapshots snapshots("data.cereal", &capabilities, &map, &relations);
+    // снимок, который не удалось прочитать, при выходе не перезаписывается пустым
+    bool loaded = false;
 
     try {
+        std::ifstream i("config.json");
+        if (!i) {
+            LOG(Error, "CALL THIS EXE FILE FROM WORKING DIRECTORY THAT CONTAINS VALID CONFIG.JSON");
+            return 0;
+        }
+        Json j;
+        i >> j;
+
+        // по умолчанию сообщения о каждом пакете (уровень debug) не выводятся
+        auto level = Log::parseLevel(j.value("log_level", std::string("info")));
+        if (!level) {
+            throw std::runtime_error("unknown 'log_level'");
+        }
+        Log::setLevel(*level);
+        Log::setPayloadRate(j.value("log_payloads_per_second", 10u));
+        Log::Writer logWriter(j.value("log_buffer", std::size_t(8192)));
+
+        if (j.contains("lateness")) {
+            relations.setLateness(seconds(j["lateness"].get<int>()));
+        }
+
+        // холодное хранилище нужно до загрузки снимка: блоки снимка могут ссылаться на его сегменты
+        if (j.contains("cold_storage")) {
+            auto const &c = j["cold_storage"];
+            try {
+                coldStore = std::make_unique<impl::ColdStore>(c["directory"].get<std::string>());
+                impl::ColdStore::setCurrent(coldStore.get());
+                snapshots.setColdStore(coldStore.get());
+                relations.setColdStorage(coldStore.get(), seconds(c["age"].get<int>()),
+                        c["memory_budget"].get<std::size_t>());
+            }
+            catch (std::exception const &e) {
+                LOG(Error, "COLD STORAGE DISABLED: " << e.what());
+            }
+        }
+
         if (std::filesystem::exists("data.cereal")) {
-            std::ifstream is("data.cereal", std::ios::binary);
-            cereal::BinaryInputArchive iarchive(is);
-            iarchive(capabilities, map, relations);
-            std::cout << "Loading data..." << std::endl;
+            LOG(Info, "Loading data...");
         } else {
-            std::cout << "Empty start..." << std::endl;
+            LOG(Info, "Empty start...");
         }
+        auto generation = snapshots.load();
+        loaded = true;
 
+        // потоки событий разбирают и отправляют сообщения параллельно; значения устройств
+        // разных частей (по номеру устройства) записываются одновременно
+        auto threads = std::max(j.value("threads", 1u), 1u);
         Commands commands(&map, &capabilities, &relations);
-        auto callback = [&commands](auto &j) { return commands.callback(j); };
+        auto callback = [&commands](auto const &...args) { return commands.callback(args...); };
+        commands.setSnapshots(&snapshots);
+        commands.setShards(j.value("shards", 4 * threads));
 
-        std::ifstream i("config.json");
-        if (!i) {
-            std::cout << "CALL THIS EXE FILE FROM WORKING DIRECTORY THAT CONTAINS VALID CONFIG.JSON"
-                    << std::endl;
-            return 0;
+        ThreadPool queries(j.value("query_threads", std::thread::hardware_concurrency()));
+        commands.setExecutor(&queries, [](auto f) { io_service.post(f); });
+
+        if (j.contains("journal")) {
+            auto const &c = j["journal"];
+            journal = std::make_unique<Journal>(c["path"].get<std::string>(),
+                    c.value("sync_records", 256), std::chrono::milliseconds(c.value("sync_ms", 1000)));
+            auto records = commands.replay(*journal, generation);
+            LOG(Info, "Replaying journal... (records: " << records << ")");
+            commands.setJournal(journal.get());
+            snapshots.setJournal(journal.get());
         }
-        Json j;
-        i >> j;
+
+        // обслуживание идёт в своих потоках; состояние на это время блокируется целиком.
+        // Интервалы - в секундах, 0 выключает задачу
+        Json m = j.value("maintenance", Json::object());
+        ThreadPool maintenance(m.value("threads", 1u));
+        Scheduler scheduler(&maintenance, m.value("jitter", 0.1));
+        auto every = [&m](char const *name, int fallback) {
+            return std::chrono::seconds(m.value(name, fallback));
+        };
+        // при включённом журнале снимки нужны только для того, чтобы журнал не рос;
+        // копия делается под блокировкой, а пишется в фоне
+        scheduler.add("snapshot", every("snapshot", j.value("snapshot_interval", 300)), [&]() {
+            auto lock = commands.lockState();
+            if (!snapshots.start()) {
+                LOG(Warning, "Previous snapshot is still being written, skipping");
+            }
+        });
+        scheduler.add("retention", every("retention", 300), [&]() {
+            auto lock = commands.lockState();
+            relations.expire(hclock::now());
+        });
+        scheduler.add("cold_spill", every("cold_spill", 300), [&]() {
+            auto lock = commands.lockState();
+            if (auto blocks = relations.spill(hclock::now())) {
+                LOG(Info, "Moved " << blocks << " blocks to cold storage");
+            }
+        });
+        // commit проверяет интервал fsync только при следующей записи: в тишине последние
+        // записи сбрасываются на диск отсюда (sync без новых записей ничего не делает).
+        // Журнал блокируется сам, состояние не нужно
+        if (journal) {
+            auto syncMs = j["journal"].value("sync_ms", 1000);
+            scheduler.add("journal_sync", std::chrono::milliseconds(syncMs), [&]() {
+                journal->sync();
+            });
+        }
+        scheduler.add("stats", every("stats", 0), [&]() {
+            Json request;
+            request["command_name"] = "server_stats";
+            LOG(Info, "Server stats: " << commands.callback(request).dump());
+        });
+        commands.setScheduler(&scheduler);
+        scheduler.start();
+
+        ConnectionSettings settings;
+        settings.maxConnections = j.value("max_connections", std::size_t(0));
+        settings.idleSeconds = j.value("idle_timeout", 0);
+        settings.coalesceMs = j.value("coalesce_ms", 2);
+        settings.coalesceBytes = j.value("coalesce_bytes", std::size_t(64 * 1024));
+        settings.highWater = j.value("send_high_water", std::size_t(0));
+        settings.streamWindow = j.value("stream_window", std::size_t(1024 * 1024));
+        settings.deflate = j.value("deflate", false);
+        settings.deflateLevel = j.value("deflate_level", -1);
+        settings.notifyMs = j.value("notify_ms", 100);
 
         if (j["mode"] == "server") {
-            std::cout << "RUNNING SERVER" << std::endl;
-            runServer([] { return Json(); }, callback, j["server"].get<int>(), save);
+            LOG(Info, "RUNNING SERVER");
+            runServer([] { return Json(); }, callback, j["server"].get<int>(), settings, threads);
             return 0;
         }
 
         if (j["mode"] == "client") {
-            std::cout << "RUNNING CLIENT" << std::endl;
-            runClient([] { return Json(); }, callback, j["client"].get<std::string>(), save);
+            LOG(Info, "RUNNING CLIENT");
+            runClient([] { return Json(); }, callback, j["client"].get<std::string>(),
+                    j.value("encoding", std::string()), settings, threads);
             return 0;
         }
     }
     catch (std::exception const &e) {
-        std::cout << "UNDEFINED ERROR: " << e.what() << std::endl;
+        LOG(Error, "UNDEFINED ERROR: " << e.what());
     }
 
-    save();
+    if (!loaded) {
+        LOG(Error, "Data was not loaded, data.cereal is left as it is");
+        return 1;
+    }
+    try {
+        relations.expire(hclock::now());
+        relations.spill(hclock::now());
+        snapshots.wait();
+        snapshots.start();
+        snapshots.wait();
+    }
+    catch (std::exception const &e) {
+        LOG(Error, "SNAPSHOT ERROR: " << e.what());
+        return 1;
+    }
 }
@@ -18,9 +18,14 @@ int main() {
             return Json::parse(buffer.str());
         };
 
-        auto msgCallback = [](Json const &j) {
-            std::cout << j << std::endl;
-            return Json();
+        // текстовые кадры сначала предлагаются быстрому разбору transmit_data, здесь его нет
+        auto msgCallback = [](auto const &j, auto &&...) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(j)>, std::string_view>) {
+                return std::optional<Json>();
+            } else {
+                std::cout << j << std::endl;
+                return Json();
+            }
         };
 
         std::ifstream i("config.json");
@@ -38,7 +43,7 @@ int main() {
             std::string sPort = uri.substr(uri.rfind(':') + 1);
             int port = std::stoi(sPort);
             std::cout << "port: " << port;
-            runServer(cntCallback, msgCallback, port, [](){});
+            runServer(cntCallback, msgCallback, port);
             return 0;
         }
 
@@ -46,7 +51,7 @@ int main() {
             std::cout << "RUNNING TEST CLIENT" << std::endl;
             auto addr = "ws://127.0.0.1:" + std::to_string(j["server"].get<int>());
             std::cout << "Connecting to " << addr << std::endl;
-            runClient(cntCallback, msgCallback, addr, [](){});
+            runClient(cntCallback, msgCallback, addr);
             return 0;
         }
     }
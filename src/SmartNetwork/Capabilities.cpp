@@ -20,12 +20,12 @@ Capabilities::findWorkMode(DeviceType deviceType, std::string_view name) {
 }
 
 std::optional<Indicator> Capabilities::findIndicator(WorkMode workMode, std::string_view name) {
-    for (auto i: workModes[workMode].indicators) {
-        if (indicators[i].name == name) {
-            return i;
-        }
+    auto const &index = workModes[workMode].indicatorIndex;
+    auto it = index.find(std::string(name));
+    if (it == index.end()) {
+        return {};
     }
-    return {};
+    return it->second;
 }
 
 std::optional<Parameter> Capabilities::findParameter(WorkMode workMode, std::string_view name) {
@@ -39,6 +39,7 @@ std::optional<Parameter> Capabilities::findParameter(WorkMode workMode, std::str
 
 WorkMode Capabilities::addWorkMode(DeviceType deviceType, std::string_view name) {
     workModes.push_back(WorkModeData{name.data(), {}, {}});
+    workModes.back().deviceType = deviceType;
     deviceTypes[deviceType].workModes.push_back(workModes.size() - 1);
     return workModes.size() - 1;
 }
@@ -49,9 +50,13 @@ Parameter Capabilities::addParameter(WorkMode workMode, std::string_view name, D
     return parameters.size() - 1;
 }
 
-Indicator Capabilities::addIndicator(WorkMode workMode, std::string_view name, DataType type) {
-    indicators.push_back(IndicatorData{name.data(), type});
+Indicator Capabilities::addIndicator(WorkMode workMode, std::string_view name, DataType type,
+        Retention retention, bool quantiles) {
+    indicators.push_back(IndicatorData{name.data(), type, retention, quantiles});
+    indicators.back().deviceType = workModes[workMode].deviceType;
     workModes[workMode].indicators.push_back(indicators.size() - 1);
+    // при одинаковых именах, как и раньше, находится первый индикатор
+    workModes[workMode].indicatorIndex.emplace(name, indicators.size() - 1);
     return indicators.size() - 1;
 }
 
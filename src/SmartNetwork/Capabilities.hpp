@@ -3,6 +3,10 @@
 #include <string>
 #include <vector>
 #include <optional>
+#include <chrono>
+#include <unordered_map>
+#include "SnapshotFormat.hpp"
+#include <cereal/types/optional.hpp>
 
 enum class DataType {
     Int,
@@ -10,6 +14,39 @@ enum class DataType {
     Bool,
 };
 
+// сколько хранить исходные значения и каждый уровень свёрток, ноль - хранить всегда.
+// Незаданный срок показателя берётся у его типа устройства, а незаданный и там
+// выводится из срока более подробного уровня (resolve)
+struct Retention {
+    std::optional<std::chrono::seconds> raw;
+    std::optional<std::chrono::seconds> minutes;
+    std::optional<std::chrono::seconds> hours;
+    std::optional<std::chrono::seconds> days;
+
+    // незаданные сроки берутся из fallback
+    Retention orElse(Retention const &fallback) const {
+        return {raw ? raw : fallback.raw, minutes ? minutes : fallback.minutes,
+                hours ? hours : fallback.hours, days ? days : fallback.days};
+    }
+
+    // все сроки заданы: исходные значения по умолчанию хранятся всегда, минутная свёртка -
+    // вчетверо дольше исходных значений, часовая - в 12 раз дольше минутной, суточная -
+    // в 10 раз дольше часовой; после уровня, хранимого всегда, все хранятся всегда
+    Retention resolve() const {
+        Retention r = *this;
+        r.raw = raw.value_or(std::chrono::seconds(0));
+        r.minutes = minutes.value_or(*r.raw * 4);
+        r.hours = hours.value_or(*r.minutes * 12);
+        r.days = days.value_or(*r.hours * 10);
+        return r;
+    }
+
+    template<class Archive>
+    void serialize(Archive &ar) {
+        ar(raw, minutes, hours, days);
+    }
+};
+
 using DeviceType = unsigned;
 
 using WorkMode = unsigned;
@@ -31,7 +68,8 @@ public:
 
     Parameter addParameter(WorkMode workMode, std::string_view name, DataType type);
 
-    Indicator addIndicator(WorkMode workMode, std::string_view name, DataType type);
+    Indicator addIndicator(WorkMode workMode, std::string_view name, DataType type,
+            Retention retention = {}, bool quantiles = false);
 
     std::optional<DeviceType> findDeviceType(std::string_view name);
 
@@ -44,6 +82,17 @@ public:
         return deviceTypes[type].name;
     }
 
+    // сроки хранения, заданные типу устройства
+    void setRetention(DeviceType type, Retention retention)
+    {
+        deviceTypes[type].retention = retention;
+    }
+
+    Retention retention(DeviceType type)
+    {
+        return deviceTypes[type].retention;
+    }
+
     std::vector<WorkMode> enumerateWorkModes(DeviceType deviceType)
     {
         return deviceTypes[deviceType].workModes;
@@ -78,6 +127,30 @@ public:
         return indicators[indicator].name;
     }
 
+    // сроки хранения, заданные самому показателю
+    void setIndicatorRetention(Indicator indicator, Retention retention)
+    {
+        indicators[indicator].retention = retention;
+    }
+
+    Retention indicatorRetention(Indicator indicator)
+    {
+        return indicators[indicator].retention;
+    }
+
+    // действующие сроки хранения рядов показателя, все заданы
+    Retention effectiveRetention(Indicator indicator)
+    {
+        auto const &i = indicators[indicator];
+        return i.retention.orElse(deviceTypes[i.deviceType].retention).resolve();
+    }
+
+    // ведут ли часовые и суточные свёртки индикатора скетчи для p50/p95/p99
+    bool indicatorQuantiles(Indicator indicator)
+    {
+        return indicators[indicator].quantiles;
+    }
+
     DataType parameterType(Parameter parameter)
     {
         return parameters[parameter].type;
@@ -96,6 +169,20 @@ public:
     template<class Archive>
     void load(Archive &ar) {
         ar(deviceTypes, workModes, parameters, indicators);
+        for (auto &w: workModes) {
+            w.indicatorIndex.clear();
+            for (auto i: w.indicators) {
+                w.indicatorIndex.emplace(indicators[i].name, i);
+            }
+        }
+        for (DeviceType type = 0; type < deviceTypes.size(); ++type) {
+            for (auto w: deviceTypes[type].workModes) {
+                workModes[w].deviceType = type;
+                for (auto i: workModes[w].indicators) {
+                    indicators[i].deviceType = type;
+                }
+            }
+        }
     }
 
 private:
@@ -103,10 +190,14 @@ private:
         std::string name;
         std::vector<WorkMode> workModes;
         bool active = false;
+        Retention retention;
 
         template<class Archive>
         void serialize(Archive &ar) {
             ar(name, workModes, active);
+            if (Archive::is_saving::value || impl::snapshotFormat > impl::LegacyFormat) {
+                ar(retention);
+            }
         }
     };
 
@@ -114,6 +205,10 @@ private:
         std::string name;
         std::vector<Parameter> parameters;
         std::vector<Indicator> indicators;
+        // индикаторы по имени, строится заново после загрузки
+        std::unordered_map<std::string, Indicator> indicatorIndex;
+        // тип устройства режима, восстанавливается после загрузки
+        DeviceType deviceType = 0;
 
         template<class Archive>
         void serialize(Archive &ar) {
@@ -134,10 +229,17 @@ private:
     struct IndicatorData {
         std::string name;
         DataType type;
+        Retention retention;
+        bool quantiles = false;
+        // тип устройства показателя, восстанавливается после загрузки
+        DeviceType deviceType = 0;
 
         template<class Archive>
         void serialize(Archive &ar) {
             ar(name, type);
+            if (Archive::is_saving::value || impl::snapshotFormat > impl::LegacyFormat) {
+                ar(retention, quantiles);
+            }
         }
     };
 
@@ -0,0 +1,183 @@
+#include "ColdStore.hpp"
+#include <filesystem>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace impl {
+    namespace {
+        ColdStore *currentStore = nullptr;
+
+        std::string segmentName(unsigned id) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "segment-%06u.bin", id);
+            return name;
+        }
+    }
+
+#ifndef _WIN32
+    Segment::Segment(std::string path, std::size_t capacity) :
+            filePath(std::move(path)), capacity(capacity) {
+        fd = ::open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ::ftruncate(fd, capacity) != 0) {
+            throw std::runtime_error("cannot create segment '" + filePath + "'");
+        }
+        void *p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("cannot map segment '" + filePath + "'");
+        }
+        base = static_cast<std::uint64_t *>(p);
+    }
+
+    Segment::Segment(std::string path) : filePath(std::move(path)) {
+        fd = ::open(filePath.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            throw std::runtime_error("cannot open segment '" + filePath + "'");
+        }
+        capacity = used = st.st_size;
+        void *p = ::mmap(nullptr, capacity, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("cannot map segment '" + filePath + "'");
+        }
+        base = static_cast<std::uint64_t *>(p);
+    }
+
+    Segment::~Segment() {
+        if (base != nullptr) {
+            ::munmap(base, capacity);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    void Segment::sync(std::size_t bytes) {
+        if (base != nullptr && bytes != 0) {
+            ::msync(base, bytes, MS_SYNC);
+        }
+    }
+#else
+    // на Windows холодное хранилище не поддерживается, блоки остаются в куче
+    Segment::Segment(std::string path, std::size_t) : filePath(std::move(path)) {
+        throw std::runtime_error("cold storage is not supported on this platform");
+    }
+
+    Segment::Segment(std::string path) : filePath(std::move(path)) {
+        throw std::runtime_error("cold storage is not supported on this platform");
+    }
+
+    Segment::~Segment() = default;
+
+    void Segment::sync(std::size_t) {}
+#endif
+
+    std::int64_t Segment::append(std::uint64_t const *words, std::size_t size) {
+        auto const bytes = size * sizeof(std::uint64_t);
+        if (used + bytes > capacity) {
+            return -1;
+        }
+        std::memcpy(reinterpret_cast<char *>(base) + used, words, bytes);
+        auto offset = used / sizeof(std::uint64_t);
+        used += bytes;
+        return offset;
+    }
+
+    ColdStore::ColdStore(std::string directory, std::size_t segmentSize) :
+            directory(std::move(directory)), segmentSize(segmentSize) {
+#ifdef _WIN32
+        throw std::runtime_error("cold storage is not supported on this platform");
+#endif
+        std::filesystem::create_directories(this->directory);
+        for (auto const &e: std::filesystem::directory_iterator(this->directory)) {
+            unsigned id;
+            if (std::sscanf(e.path().filename().string().c_str(), "segment-%u.bin", &id) == 1) {
+                nextId = std::max(nextId, id + 1);
+            }
+        }
+    }
+
+    ColdStore::Location ColdStore::write(std::uint64_t const *words, std::size_t size) {
+        std::lock_guard lock(mutex);
+        if (active) {
+            auto offset = active->append(words, size);
+            if (offset >= 0) {
+                return {active, std::uint64_t(offset)};
+            }
+        }
+
+        // блок больше сегмента получает собственный сегмент
+        auto capacity = std::max(segmentSize, size * sizeof(std::uint64_t));
+        auto name = segmentName(nextId++);
+        active = std::make_shared<Segment>(directory + "/" + name, capacity);
+        segments[name] = active;
+        return {active, std::uint64_t(active->append(words, size))};
+    }
+
+    std::shared_ptr<Segment> ColdStore::open(std::string const &name) {
+        std::lock_guard lock(mutex);
+        auto it = segments.find(name);
+        if (it != segments.end()) {
+            if (auto segment = it->second.lock()) {
+                return segment;
+            }
+        }
+        auto segment = std::make_shared<Segment>(directory + "/" + name);
+        segments[name] = segment;
+        return segment;
+    }
+
+    std::string ColdStore::name(Segment const &segment) const {
+        return std::filesystem::path(segment.path()).filename().string();
+    }
+
+    void ColdStore::sync() {
+        // сегменты только дописываются: уже занятая часть не меняется, пока идёт msync
+        std::vector<std::pair<std::shared_ptr<Segment>, std::size_t>> live;
+        {
+            std::lock_guard lock(mutex);
+            for (auto const &s: segments) {
+                if (auto segment = s.second.lock()) {
+                    live.emplace_back(segment, segment->size());
+                }
+            }
+        }
+        for (auto const &[segment, bytes]: live) {
+            segment->sync(bytes);
+        }
+    }
+
+    void ColdStore::collect() {
+        std::lock_guard lock(mutex);
+        std::vector<std::filesystem::path> unused;
+        for (auto const &e: std::filesystem::directory_iterator(directory)) {
+            auto it = segments.find(e.path().filename().string());
+            if (it == segments.end() || it->second.expired()) {
+                unused.push_back(e.path());
+            }
+        }
+
+        for (auto const &path: unused) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            segments.erase(path.filename().string());
+        }
+    }
+
+    ColdStore *ColdStore::current() {
+        return currentStore;
+    }
+
+    void ColdStore::setCurrent(ColdStore *store) {
+        currentStore = store;
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+
+namespace impl {
+    // файл фиксированного размера, отображённый в память; данные только дописываются
+    class Segment {
+    public:
+        Segment(std::string path, std::size_t capacity);
+
+        explicit Segment(std::string path);
+
+        Segment(Segment const &) = delete;
+
+        Segment &operator=(Segment const &) = delete;
+
+        ~Segment();
+
+        std::uint64_t const *data() const {
+            return base;
+        }
+
+        std::string const &path() const {
+            return filePath;
+        }
+
+        // копирует слова в конец сегмента, возвращает их смещение или -1, если нет места
+        std::int64_t append(std::uint64_t const *words, std::size_t size);
+
+        // занятые байты; меняется только под блокировкой хранилища
+        std::size_t size() const {
+            return used;
+        }
+
+        // сбрасывает на диск первые bytes байт
+        void sync(std::size_t bytes);
+
+    private:
+        std::string filePath;
+        std::uint64_t *base = nullptr;
+        std::size_t capacity = 0;
+        std::size_t used = 0;
+        int fd = -1;
+    };
+
+    // холодное хранилище запечатанных блоков: сегменты в отдельном каталоге,
+    // страницы которых держит в памяти кэш операционной системы, а не куча процесса.
+    // open() может вызываться из потоков, читающих снимок
+    class ColdStore {
+    public:
+        explicit ColdStore(std::string directory, std::size_t segmentSize = 64 << 20);
+
+        struct Location {
+            std::shared_ptr<Segment> segment;
+            std::uint64_t offset;
+        };
+
+        Location write(std::uint64_t const *words, std::size_t size);
+
+        // отображает сегмент, на который ссылается загружаемый снимок
+        std::shared_ptr<Segment> open(std::string const &name);
+
+        std::string name(Segment const &segment) const;
+
+        // сбрасывает сегменты на диск перед сохранением снимка; блокировка держится
+        // только пока собирается список, запись в хранилище во время msync не ждёт
+        void sync();
+
+        // удаляет файлы сегментов, на которые больше не ссылается ни один блок
+        void collect();
+
+        // хранилище, из которого загружаются блоки снимка
+        static ColdStore *current();
+
+        static void setCurrent(ColdStore *store);
+
+    private:
+        std::string directory;
+        std::size_t segmentSize;
+        unsigned nextId = 0;
+        std::shared_ptr<Segment> active;
+        std::map<std::string, std::weak_ptr<Segment>> segments;
+        std::mutex mutex;
+    };
+}
@@ -1,20 +1,33 @@
 #include "Commands.hpp"
+#include <limits>
+#include <map>
 
-Json Commands::historyJson() {
-    auto history = Json::array();
-    for (auto &p: currentHistory) {
-        p.second["time"] = timeAndDate(p.first);
-        history.push_back(p.second);
-    }
-    return history;
+void Commands::historyHead(std::string &out) {
+    out += R"({"command_name":"history","data":[)";
+}
+
+std::string Commands::historyText(Device id, HistoryWriter &rows) {
+    std::string out;
+    historyHead(out);
+    rows.write(out, std::numeric_limits<std::size_t>::max());
+    out += "],\"device_id\":" + std::to_string(id) + "}";
+    return out;
 }
 
 std::string timeAndDate(hclock::time_point now) {
     auto in_time_t = hclock::to_time_t(now);
 
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%dT%H:%M:%S");
-    return ss.str();
+    // история форматируется и в пуле потоков, поэтому без общего буфера localtime
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &in_time_t);
+#else
+    localtime_r(&in_time_t, &tm);
+#endif
+
+    // вызывается на каждую строку истории, поэтому без потоков ввода-вывода
+    char buf[32];
+    return std::string(buf, std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm));
 }
 
 hclock::time_point timePoint(const std::string &date) {
@@ -46,10 +59,18 @@ ApproxMode parseApprox(std::string const &mode) {
         return ApproxMode::Last;
     } else if (mode == "avg") {
         return ApproxMode::Average;
+    } else if (mode == "p50") {
+        return ApproxMode::P50;
+    } else if (mode == "p95") {
+        return ApproxMode::P95;
+    } else if (mode == "p99") {
+        return ApproxMode::P99;
     }
     throw std::runtime_error("invalid approximation mode");
 }
 
+constexpr seconds maxInterval(3600 * 24 * 366);
+
 seconds parseInterval(std::string const &mode) {
     if (mode == "hours") {
         return seconds(3600);
@@ -61,6 +82,43 @@ seconds parseInterval(std::string const &mode) {
     throw std::runtime_error("invalid approximation interval");
 }
 
+// срок хранения задаётся в секундах для исходных данных и каждого уровня свёрток:
+// поле, которого нет, не меняется, null снимает заданный срок
+Retention parseRetention(Json const &json, Retention retention) {
+    auto parse = [&json](char const *name, std::optional<seconds> &field) {
+        if (!json.contains(name)) {
+            return;
+        }
+        if (json[name].is_null()) {
+            field.reset();
+            return;
+        }
+        auto value = json[name].get<long long>();
+        if (value < 0) {
+            throw std::runtime_error(std::string("retention '") + name + "' must not be negative");
+        }
+        field = seconds(value);
+    };
+    parse("raw", retention.raw);
+    parse("minutes", retention.minutes);
+    parse("hours", retention.hours);
+    parse("days", retention.days);
+    return retention;
+}
+
+// незаданный срок выводится как null
+Json retentionJson(Retention const &retention) {
+    auto field = [](std::optional<seconds> const &value) {
+        return value ? Json(value->count()) : Json();
+    };
+    Json json;
+    json["raw"] = field(retention.raw);
+    json["minutes"] = field(retention.minutes);
+    json["hours"] = field(retention.hours);
+    json["days"] = field(retention.days);
+    return json;
+}
+
 std::string typeString(DataType type) {
     switch (type) {
         case DataType::Int:
@@ -80,7 +138,7 @@ Json Commands::transmitData(Json const &json) {
     auto id = json["device_id"].get<Device>();
     auto time = timePoint(json["time"].get<std::string>());
 
-    transmitJson.clear();
+    Json out = Json::array();
     if (!json.contains("data")) {
         return errorJson(map->getPath(id).data(), "transmit_data",
                 "'data' is required json parameter");
@@ -94,23 +152,102 @@ Json Commands::transmitData(Json const &json) {
         auto iType = capabilities->indicatorType(indicator);
 
         if (iType == DataType::Float) {
-            relations->transmit([this](auto &&...args) { transmit(args...); },
-                    id, indicator, val.get<float>(), time);
+            ingest(out, id, indicator, val.get<float>(), time);
         }
         if (iType == DataType::Int) {
-            relations->transmit([this](auto &&...args) { transmit(args...); },
-                    id, indicator, val.get<int>(), time);
+            ingest(out, id, indicator, val.get<int>(), time);
         }
         if (iType == DataType::Bool) {
-            relations->transmit([this](auto &&...args) { transmit(args...); },
-                    id, indicator, val.get<bool>(), time);
+            ingest(out, id, indicator, val.get<bool>(), time);
         }
     }
-    return transmitJson;
+    return out;
 }
 
-Json Commands::history(Json const &json) {
-    auto id = json["device_id"].get<Device>();
+Json Commands::transmitBatch(Json const &json) {
+    if (!json.contains("data")) {
+        return errorJson("", "transmit_batch", "'data' is required json parameter");
+    }
+
+    // все значения пакета проверяются до записи первого из них
+    std::vector<Relations::BatchSample> samples;
+    for (auto const &group: json["data"]) {
+        auto name = group["name"].get<std::string>();
+        auto const &devices = group["device_id"];
+        auto const &times = group["time"];
+        auto const &values = group["value"];
+        if (!devices.is_array() || !values.is_array() || devices.size() != values.size() ||
+                (times.is_array() && times.size() != devices.size())) {
+            throw std::runtime_error("'device_id', 'time' and 'value' of '" + name +
+                    "' must be arrays of the same size");
+        }
+
+        // показатель ищется один раз на режим работы, время разбирается один раз на строку
+        std::optional<WorkMode> workMode;
+        Indicator indicator = 0;
+        DataType type = DataType::Float;
+        std::string const *timeText = nullptr;
+        time_point time;
+        for (std::size_t i = 0; i < devices.size(); ++i) {
+            auto id = devices[i].get<Device>();
+            if (workMode != map->getWorkMode(id)) {
+                workMode = map->getWorkMode(id);
+                indicator = findIndicator(id, name);
+                type = capabilities->indicatorType(indicator);
+            }
+
+            auto const &t = (times.is_array() ? times[i] : times).get_ref<std::string const &>();
+            if (timeText == nullptr || *timeText != t) {
+                timeText = &t;
+                time = timePoint(t);
+            }
+
+            Relations::BatchSample sample{id, indicator, time, {}};
+            if (type == DataType::Float) {
+                sample.value = values[i].get<float>();
+            }
+            if (type == DataType::Int) {
+                sample.value = values[i].get<int>();
+            }
+            if (type == DataType::Bool) {
+                sample.value = values[i].get<bool>();
+            }
+            samples.push_back(sample);
+        }
+    }
+
+    Json out = Json::array();
+    for (auto const &s: samples) {
+        std::visit([&](auto val) { journalSample(s.transmitter, s.indicator, val, s.time); },
+                s.value);
+    }
+    relations->transmit([this, &out](auto &&...args) { transmit(out, args...); }, samples);
+
+    // одно сообщение на получателя и время, со значениями всех показателей пакета
+    Json result = Json::array();
+    std::map<std::pair<Device, std::string>, std::size_t> index;
+    for (auto &t: out) {
+        if (!t.contains("data")) {
+            result.push_back(std::move(t));
+            continue;
+        }
+        auto key = std::make_pair(t["device_id"].get<Device>(), t["time"].get<std::string>());
+        auto [it, inserted] = index.emplace(key, result.size());
+        if (inserted) {
+            result.push_back(std::move(t));
+        } else {
+            for (auto &d: t["data"]) {
+                result[it->second]["data"].push_back(std::move(d));
+            }
+        }
+    }
+    return result;
+}
+
+Commands::HistoryRequest Commands::historyRequest(Json const &json, bool stream) {
+    HistoryRequest request;
+    request.id = json["device_id"].get<Device>();
+    auto id = request.id;
     time_point startDate = timePoint(json["start_date"].get<std::string>());
 
     time_point endDate;
@@ -121,44 +258,215 @@ Json Commands::history(Json const &json) {
     }
 
     seconds interval(0);
-    if (json.contains("interval")) {
+    if (json.contains("interval_seconds")) {
+        interval = seconds(json["interval_seconds"].get<std::int64_t>());
+        if (interval <= seconds(0)) {
+            throw std::runtime_error("'interval_seconds' must be positive");
+        }
+        // границы интервалов считаются в наносекундах system_clock (±292 года):
+        // интервал больше года уже не дробит реальную историю, а сдвиги на него
+        // вблизи краёв диапазона переполнились бы
+        if (interval > maxInterval) {
+            throw std::runtime_error("'interval_seconds' must not exceed " +
+                    std::to_string(maxInterval.count()));
+        }
+    } else if (json.contains("interval")) {
         interval = parseInterval(json["interval"].get<std::string>());
     }
 
-    ApproxMode approx = ApproxMode::Average;
+    // список режимов считается за один проход, значения ряда в строке идут объектом
+    // {"avg": ..., "max": ...}; один режим строкой - просто значением, как раньше
+    std::vector<ApproxMode> approx{ApproxMode::Average};
     if (json.contains("approx")) {
-        approx = parseApprox(json["approx"].get<std::string>());
+        auto const &modes = json["approx"];
+        if (modes.is_array()) {
+            approx.clear();
+            for (auto const &m: modes) {
+                auto name = m.get<std::string>();
+                if (std::find(request.fields.begin(), request.fields.end(), name) ==
+                        request.fields.end()) {
+                    approx.push_back(parseApprox(name));
+                    request.fields.push_back(name);
+                }
+            }
+            if (approx.empty()) {
+                throw std::runtime_error("'approx' list is empty");
+            }
+        } else {
+            approx = {parseApprox(modes.get<std::string>())};
+        }
+    }
+    if (interval == seconds(0)) {
+        request.fields.clear();
+    }
+
+    // параметр, связанный с несколькими показателями, можно считать как один ряд
+    bool aggregateSources = false;
+    if (json.contains("aggregate_sources")) {
+        aggregateSources = json["aggregate_sources"].get<bool>();
     }
 
-    currentHistory.clear();
     if (json.contains("parameter")) {
         for (auto const &p: json["parameter"]) {
             Parameter param = findParameter(id, p["name"]);
-            relations->parameterHistory(
-                    [this](auto &&...args) { prepareHistory(args...); }, id,
-                    param, startDate, endDate, interval, approx);
+            if (stream) {
+                auto s = relations->parameterHistoryStream(id, param, startDate, endDate, interval,
+                        approx, aggregateSources);
+                if (s) {
+                    request.streams.push_back(std::move(*s));
+                }
+            } else {
+                auto task = relations->parameterHistoryTask(id, param, startDate, endDate,
+                        interval, approx, aggregateSources);
+                if (task) {
+                    request.tasks.push_back(std::move(*task));
+                }
+            }
         }
     }
 
     if (json.contains("indicator")) {
         for (auto const &i: json["indicator"]) {
             Indicator indicator = findIndicator(id, i);
-            relations->indicatorHistory(
-                    [this](auto &&...args) { prepareHistory(args...); }, id,
-                    indicator, startDate, endDate, interval, approx);
+            if (stream) {
+                auto s = relations->indicatorHistoryStream(id, indicator, startDate, endDate,
+                        interval, approx);
+                if (s) {
+                    request.streams.push_back(std::move(*s));
+                }
+            } else {
+                auto task = relations->indicatorHistoryTask(id, indicator, startDate, endDate,
+                        interval, approx);
+                if (task) {
+                    request.tasks.push_back(std::move(*task));
+                }
+            }
         }
     }
+    return request;
+}
 
-    Json result;
-    result["data"] = historyJson();
-    result["device_id"] = id;
-    return result;
+HistoryWriter Commands::historyRows(HistoryRequest const &request) {
+    HistoryWriter rows;
+    for (auto const &t: request.tasks) {
+        rows.add(t.name, request.fields, t.run());
+    }
+    return rows;
+}
+
+Json Commands::history(Json const &json) {
+    // сюда попадают только вызовы без reply, которым нужен Json; клиентам соединений
+    // история отправляется текстом из callback
+    auto request = historyRequest(json);
+    auto rows = historyRows(request);
+    return Json::parse(historyText(request.id, rows));
+}
+
+std::shared_ptr<Commands::HistoryChunks> Commands::historyChunks(HistoryRequest &request,
+        std::size_t chunkRows) {
+    auto chunks = std::make_shared<HistoryChunks>();
+    for (auto &s: request.streams) {
+        chunks->rows.add(s.name, request.fields, std::move(s.next));
+    }
+    chunks->id = request.id;
+    chunks->chunkRows = chunkRows;
+    return chunks;
+}
+
+std::string Commands::nextChunk(HistoryChunks &chunks) {
+    std::string chunk;
+    historyHead(chunk);
+    chunks.final = chunks.rows.write(chunk, chunks.chunkRows) < chunks.chunkRows;
+    chunk += "],\"device_id\":" + std::to_string(chunks.id) +
+            ",\"final\":" + (chunks.final ? "true" : "false") +
+            ",\"sequence\":" + std::to_string(chunks.sequence++) + "}";
+    return chunk;
+}
+
+void Commands::streamChunks(ThreadPool *pool, Post post, std::shared_ptr<HistoryChunks> chunks,
+        Reply reply, Drain drain) {
+    pool->submit([pool, post, chunks, reply, drain]() {
+        std::string chunk;
+        try {
+            chunk = nextChunk(*chunks);
+        }
+        catch (std::exception const &e) {
+            auto error = errorJson("", "history", e.what());
+            error["command_name"] = "history";
+            chunk = error.dump();
+            chunks->final = true;
+        }
+        // в очереди отправки не больше одной части сверх того, что ждёт drain
+        post([pool, post, chunks, reply, drain, chunk = std::move(chunk)]() {
+            reply(chunk);
+            if (chunks->final) {
+                return;
+            }
+            auto next = [pool, post, chunks, reply, drain]() {
+                streamChunks(pool, post, chunks, reply, drain);
+            };
+            if (drain) {
+                drain(next);
+            } else {
+                next();
+            }
+        });
+    });
+}
+
+void Commands::submitHistory(HistoryRequest request, Reply reply) {
+    // каждый ряд считается отдельной задачей, последняя собирает общий ответ
+    struct State {
+        HistoryRequest request;
+        std::vector<Relations::HistoryColumns> results;
+        std::atomic<std::size_t> remaining;
+        std::mutex mutex;
+        std::string error;
+    };
+    auto state = std::make_shared<State>();
+    state->results.resize(request.tasks.size());
+    state->remaining = request.tasks.size();
+    state->request = std::move(request);
+
+    for (std::size_t i = 0; i < state->request.tasks.size(); ++i) {
+        pool->submit([state, i, reply, post = post]() {
+            try {
+                state->results[i] = state->request.tasks[i].run();
+            }
+            catch (std::exception const &e) {
+                std::lock_guard lock(state->mutex);
+                state->error = e.what();
+            }
+            if (--state->remaining != 0) {
+                return;
+            }
+
+            std::string result;
+            if (state->error.empty()) {
+                HistoryWriter rows;
+                for (std::size_t k = 0; k < state->results.size(); ++k) {
+                    rows.add(state->request.tasks[k].name, state->request.fields,
+                            std::move(state->results[k]));
+                }
+                result = historyText(state->request.id, rows);
+            } else {
+                auto error = errorJson("", "history", state->error);
+                error["command_name"] = "history";
+                result = error.dump();
+            }
+            post([reply, result = std::move(result)]() { reply(result); });
+        });
+    }
 }
 
 Json Commands::addDeviceType(Json const &json) {
     auto typeName = json["name"].get<std::string>();
     auto type = capabilities->addDeviceType(typeName);
 
+    if (json.contains("retention")) {
+        capabilities->setRetention(type, parseRetention(json["retention"], {}));
+    }
+
     if (!json.contains("work_modes")) {
         return errorJson(typeName, "add_device_type",
                 "'work_modes' is required json parameter");
@@ -178,9 +486,16 @@ Json Commands::addDeviceType(Json const &json) {
 
         if (wm.contains("indicators")) {
             for (auto p: wm["indicators"]) {
+                // показатель может переопределить сроки хранения своего типа устройства
+                Retention r;
+                if (p.contains("retention")) {
+                    r = parseRetention(p["retention"], r);
+                }
+                // скетчи для p50/p95/p99 по часовым и суточным свёрткам включаются явно
+                auto quantiles = p.contains("quantiles") && p["quantiles"].get<bool>();
                 capabilities->addIndicator(workMode,
                         p["name"].get<std::string>(),
-                        parseDataType(p["type"].get<std::string>()));
+                        parseDataType(p["type"].get<std::string>()), r, quantiles);
             }
         }
     }
@@ -208,6 +523,7 @@ Json Commands::deviceTypeInfo(const Json &) {
     for (DeviceType type: capabilities->enumerateDeviceTypes()) {
         Json deviceType;
         deviceType["name"] = capabilities->deviceTypeName(type).data();
+        deviceType["retention"] = retentionJson(capabilities->retention(type));
 
         auto workModes = capabilities->enumerateWorkModes(type);
         for (WorkMode wm: workModes) {
@@ -218,13 +534,15 @@ Json Commands::deviceTypeInfo(const Json &) {
                 Json indicator;
                 indicator["name"] = capabilities->indicatorName(i).data();
                 indicator["type"] = typeString(capabilities->indicatorType(i));
+                indicator["retention"] = retentionJson(capabilities->effectiveRetention(i));
+                indicator["quantiles"] = capabilities->indicatorQuantiles(i);
                 workMode["indicators"].push_back(indicator);
             }
 
             for (Indicator i: capabilities->enumerateParameters(wm)) {
                 Json parameter;
                 parameter["name"] = capabilities->parameterName(i).data();
-                std::cout << capabilities->parameterName(i).data() << std::endl;
+                LOG(Debug, capabilities->parameterName(i));
                 parameter["type"] = typeString(capabilities->parameterType(i));
                 workMode["parameters"].push_back(parameter);
             }
@@ -262,13 +580,15 @@ Json Commands::deviceConfigInfo(const Json &json) {
                 Json indicator;
                 indicator["name"] = capabilities->indicatorName(i).data();
                 indicator["type"] = typeString(capabilities->indicatorType(i));
+                indicator["retention"] = retentionJson(capabilities->effectiveRetention(i));
+                indicator["quantiles"] = capabilities->indicatorQuantiles(i);
                 workMode["indicators"].push_back(indicator);
             }
 
             for (Indicator i: capabilities->enumerateParameters(wm)) {
                 Json parameter;
                 parameter["name"] = capabilities->parameterName(i).data();
-                std::cout << capabilities->parameterName(i).data() << std::endl;
+                LOG(Debug, capabilities->parameterName(i));
                 parameter["type"] = typeString(capabilities->parameterType(i));
                 workMode["parameters"].push_back(parameter);
             }
@@ -299,6 +619,7 @@ Json Commands::addDevice(Json const &json) {
     }
 
     auto id = map->add(location, *deviceType, *workMode);
+    subscriptions.relocate(subscriptionDevices(), subscriptionIndicator());
 
     Json res;
     res["device_id"] = id;
@@ -331,6 +652,8 @@ Json Commands::findDevice(Json const &json) {
 Json Commands::removeDevice(Json const &json) {
     auto id = json["device_id"].get<Device>();
     map->remove(id);
+    subscriptions.forget(id, subscriptionIndicator());
+    subscriptions.relocate(subscriptionDevices(), subscriptionIndicator());
     return {};
 }
 
@@ -338,6 +661,55 @@ Json Commands::setWorkMode(Json const &json) {
     auto id = json["device_id"].get<Device>();
     auto wm = capabilities->findWorkMode(map->deviceType(id), json["work_mode"].get<std::string>());
     map->setWorkMode(id, *wm);
+    subscriptions.rebind(id, subscriptionIndicator());
+    return {};
+}
+
+Json Commands::setRetention(Json const &json) {
+    auto typeStr = json["device_type"].get<std::string>();
+    auto type = capabilities->findDeviceType(typeStr);
+    if (!type.has_value()) {
+        throw std::runtime_error("device type '" + typeStr + "' is not exist");
+    }
+    if (!json.contains("retention")) {
+        return errorJson(typeStr, "set_retention", "'retention' is required json parameter");
+    }
+
+    if (!json.contains("indicator")) {
+        capabilities->setRetention(*type,
+                parseRetention(json["retention"], capabilities->retention(*type)));
+        relations->updateRetention();
+        return {};
+    }
+
+    // без work_mode меняется показатель с этим именем во всех режимах типа
+    auto name = json["indicator"].get<std::string>();
+    std::vector<WorkMode> workModes;
+    if (json.contains("work_mode")) {
+        auto wmStr = json["work_mode"].get<std::string>();
+        auto wm = capabilities->findWorkMode(*type, wmStr);
+        if (!wm.has_value()) {
+            throw std::runtime_error("work mode '" + wmStr + "' is not exist");
+        }
+        workModes.push_back(*wm);
+    } else {
+        workModes = capabilities->enumerateWorkModes(*type);
+    }
+
+    std::vector<Indicator> indicators;
+    for (auto wm: workModes) {
+        if (auto i = capabilities->findIndicator(wm, name)) {
+            indicators.push_back(*i);
+        }
+    }
+    if (indicators.empty()) {
+        throw std::runtime_error("indicator '" + name + "' is not exist");
+    }
+    for (auto i: indicators) {
+        capabilities->setIndicatorRetention(i,
+                parseRetention(json["retention"], capabilities->indicatorRetention(i)));
+    }
+    relations->updateRetention();
     return {};
 }
 
@@ -345,6 +717,7 @@ Json Commands::setLocation(Json const &json) {
     auto id = json["device_id"].get<Device>();
     auto location = json["location"].get<std::string>();
     map->setPath(id, location);
+    subscriptions.relocate(subscriptionDevices(), subscriptionIndicator());
     return {};
 }
 
@@ -363,7 +736,197 @@ Json Commands::link(Json const &json, bool unlink) {
     return {};
 }
 
-Json Commands::callback(Json const &json) {
+// команды, меняющие состояние; transmit_data и transmit_batch журналируются по отдельным значениям
+bool isMutating(std::string const &command) {
+    return command == "add_device_type" || command == "remove_device_type" ||
+            command == "add_device" || command == "remove_device" ||
+            command == "set_work_mode" || command == "set_location" ||
+            command == "set_retention" || command == "link" || command == "unlink";
+}
+
+// команды, которые пишут в журнал: изменяющие записывают себя, передачи - значения
+bool isJournaled(std::string const &command) {
+    return isMutating(command) || command == "transmit_data" || command == "transmit_batch";
+}
+
+Json Commands::dispatch(std::string const &command, Json const &json) {
+    // связи, режимы и типы устройств могли измениться: планы передачи собираются заново
+    if (isMutating(command)) {
+        relations->invalidateFanOut();
+    }
+    if (command == "transmit_data") {
+        return transmitData(json);
+    } else if (command == "transmit_batch") {
+        return transmitBatch(json);
+    } else if (command == "history") {
+        return history(json);
+    } else if (command == "add_device_type") {
+        return addDeviceType(json);
+    } else if (command == "remove_device_type") {
+        return removeDeviceType(json);
+    } else if (command == "device_type_info") {
+        return deviceTypeInfo(json);
+    } else if (command == "add_device") {
+        return addDevice(json);
+    } else if (command == "device_info") {
+        return deviceInfo(json);
+    } else if (command == "find_device") {
+        return findDevice(json);
+    } else if (command == "remove_device") {
+        return removeDevice(json);
+    } else if (command == "set_work_mode") {
+        return setWorkMode(json);
+    } else if (command == "set_location") {
+        return setLocation(json);
+    } else if (command == "set_retention") {
+        return setRetention(json);
+    } else if (command == "link") {
+        return link(json, false);
+    } else if (command == "unlink") {
+        return link(json, true);
+    } else if (command == "list_locations") {
+        return listLocations(json);
+    } else if (command == "device_config_info") {
+        return deviceConfigInfo(json);
+    } else if (command == "server_stats") {
+        return serverStats(json);
+    } else if (command == "subscribe") {
+        return subscribe(json);
+    } else if (command == "unsubscribe") {
+        return unsubscribe(json);
+    } else if (command == "stop") {
+        return Json();
+    }
+
+    Json result;
+    result["error"] = "undefined_command";
+    return result;
+}
+
+Json Commands::serverStats(Json const &) {
+    Json res;
+    res["late_dropped"] = relations->droppedLate();
+    if (snapshots != nullptr) {
+        auto stats = snapshots->stats();
+        res["snapshot"]["count"] = stats.count;
+        res["snapshot"]["running"] = stats.running;
+        res["snapshot"]["duration_ms"] = stats.duration.count();
+        res["snapshot"]["bytes"] = stats.bytes;
+    }
+    if (scheduler != nullptr) {
+        res["maintenance"] = Json::array();
+        for (auto const &job: scheduler->stats()) {
+            Json j;
+            j["name"] = job.name;
+            j["interval_s"] = std::chrono::duration<double>(job.interval).count();
+            j["runs"] = job.runs;
+            j["skipped"] = job.skipped;
+            j["running"] = job.running;
+            j["duration_ms"] = job.duration.count();
+            if (!job.error.empty()) {
+                j["error"] = job.error;
+            }
+            res["maintenance"].push_back(j);
+        }
+    }
+    return res;
+}
+
+Json Commands::subscribe(Json const &json) {
+    if (!json.contains("subscriber")) {
+        return errorJson("", "subscribe", "subscriptions need a connection to deliver to");
+    }
+    auto name = json["name"].get<std::string>();
+    std::vector<Device> devices;
+    std::optional<Subscriptions::Location> location;
+    if (json.contains("location")) {
+        location = Subscriptions::Location{json["location"].get<std::string>(),
+                json.value("match", true)};
+        devices = subscriptionDevices()(*location);
+    } else if (json["device_id"].is_array()) {
+        devices = json["device_id"].get<std::vector<Device>>();
+    } else {
+        devices.push_back(json["device_id"].get<Device>());
+    }
+
+    // показатель с этим именем ищется в текущем режиме каждого устройства
+    auto find = subscriptionIndicator();
+    Json found = Json::array();
+    for (auto device: devices) {
+        if (find(device, name)) {
+            found.push_back(device);
+        }
+    }
+    // подписка на расположение ждёт устройства, которые туда ещё попадут
+    if (found.empty() && !location) {
+        return errorJson("", "subscribe", "no devices with indicator '" + name + "'");
+    }
+
+    Subscriptions::Filter filter;
+    if (json.contains("deadband")) {
+        filter.deadband = json["deadband"].get<double>();
+    }
+    filter.minInterval = std::chrono::milliseconds(json.value("min_interval", 0));
+
+    Json res;
+    res["subscription_id"] = subscriptions.add(json["subscriber"].get<Subscriptions::Subscriber>(),
+            name, std::move(devices), std::move(location), filter, find);
+    res["device_id"] = std::move(found);
+    return res;
+}
+
+Json Commands::unsubscribe(Json const &json) {
+    auto subscriber = json.value("subscriber", Subscriptions::Subscriber(0));
+    if (json.value("all", false)) {
+        subscriptions.removeAll(subscriber);
+        return {};
+    }
+    auto id = json["subscription_id"].get<std::uint64_t>();
+    if (!subscriptions.remove(subscriber, id)) {
+        return errorJson("", "unsubscribe", "unknown subscription " + std::to_string(id));
+    }
+    Json res;
+    res["subscription_id"] = id;
+    return res;
+}
+
+Json Commands::notify(Json result) {
+    if (subscriptions.empty()) {
+        return result;
+    }
+    auto notices = subscriptions.take();
+    if (notices.empty()) {
+        return result;
+    }
+    if (!result.is_array()) {
+        result = result.empty() ? Json::array() : Json::array({std::move(result)});
+    }
+    // одно сообщение на подписку
+    for (std::size_t i = 0; i < notices.size(); ++i) {
+        auto const &n = notices[i];
+        if (i == 0 || n.id != notices[i - 1].id) {
+            Json message;
+            message["command_name"] = "notify";
+            message["subscriber"] = n.subscriber;
+            message["subscription_id"] = n.id;
+            message["data"] = Json::array();
+            result.push_back(std::move(message));
+        }
+        Json item;
+        item["device_id"] = n.device;
+        item["name"] = n.name;
+        item["time"] = timeAndDate(n.time);
+        std::visit([&item](auto v) { item["value"] = v; }, n.value);
+        result.back()["data"].push_back(std::move(item));
+    }
+    return result;
+}
+
+Json Commands::callback() {
+    return notify(Json());
+}
+
+Json Commands::callback(Json const &json, Reply reply, Drain drain) {
     if (!json.contains("command_name")) {
         return errorJson(
                 "undefined command", "request",
@@ -371,50 +934,144 @@ Json Commands::callback(Json const &json) {
     }
 
     auto command = json["command_name"].get<std::string>();
-    std::cout << "Accepted command: " << command << std::endl;
+    LOG(Debug, "Accepted command: " << command);
 
     Json result;
     try {
-        if (command == "transmit_data") {
-            result = transmitData(json);
-        } else if (command == "history") {
-            result = history(json);
-        } else if (command == "add_device_type") {
-            result = addDeviceType(json);
-        } else if (command == "remove_device_type") {
-            result = removeDeviceType(json);
-        } else if (command == "device_type_info") {
-            result = deviceTypeInfo(json);
-        } else if (command == "add_device") {
-            result = addDevice(json);
-        } else if (command == "device_info") {
-            result = deviceInfo(json);
-        } else if (command == "find_device") {
-            result = findDevice(json);
-        } else if (command == "remove_device") {
-            result = removeDevice(json);
-        } else if (command == "set_work_mode") {
-            result = setWorkMode(json);
-        } else if (command == "set_location") {
-            result = setLocation(json);
-        } else if (command == "link") {
-            result = link(json, false);
-        } else if (command == "unlink") {
-            result = link(json, true);
-        } else if (command == "list_locations") {
-            result = listLocations(json);
-        } else if (command == "device_config_info") {
-            result = deviceConfigInfo(json);
-        } else if (command == "stop") {
-            result = Json();
-        } else
-        {
-            result = Json();
-            result["error"] = "undefined_command";
+        // значения разных устройств пишутся параллельно, каждое под блокировкой своей части;
+        // пакет обычно затрагивает почти все части и блокирует их все
+        if (command == "transmit_data" || command == "transmit_batch") {
+            std::shared_lock stateLock(state);
+            std::vector<std::unique_lock<std::mutex>> shardLocks;
+            if (command == "transmit_data") {
+                shardLocks.emplace_back(shard(json.value("device_id", Device(0))));
+            } else {
+                for (auto &m: shards) {
+                    shardLocks.emplace_back(m);
+                }
+            }
+            result = dispatch(command, json);
+        } else {
+            std::unique_lock stateLock(state);
+            // команда попадает в журнал до выполнения: при проигрывании она завершится так же
+            if (journal != nullptr && isMutating(command)) {
+                Journal::Record record(Journal::Kind::Command);
+                auto cbor = Json::to_cbor(json);
+                record.put(std::string(cbor.begin(), cbor.end()));
+                journal->append(record);
+            }
+            // ответ частями: строки идут по времени, каждая часть - отдельное сообщение
+            // с номером sequence, у последней final = true
+            if (command == "history" && reply && json.value("stream", false)) {
+                auto chunkRows = std::max<std::size_t>(
+                        json.value("chunk_rows", std::size_t(1000)), 1);
+                auto request = historyRequest(json, true);
+                auto chunks = historyChunks(request, chunkRows);
+                if (pool == nullptr) {
+                    while (!chunks->final) {
+                        reply(nextChunk(*chunks));
+                    }
+                } else {
+                    streamChunks(pool, post, std::move(chunks), std::move(reply),
+                            std::move(drain));
+                }
+                return Json();
+            }
+
+            // ответ уходит клиенту текстом, который пишет HistoryWriter, без DOM: в пуле
+            // потоков или, без пула, прямо здесь
+            if (command == "history" && reply) {
+                auto request = historyRequest(json);
+                if (pool != nullptr && !request.tasks.empty()) {
+                    submitHistory(std::move(request), std::move(reply));
+                    return Json();
+                }
+                auto rows = historyRows(request);
+                reply(historyText(request.id, rows));
+                return Json();
+            }
+            result = dispatch(command, json);
         }
     } catch (std::exception const &e) {
         result = errorJson("", command, e.what());
     }
+    return notify(finish(command, std::move(result)));
+}
+
+std::optional<Json> Commands::callback(std::string_view text) {
+    // буферы разбора переиспользуются, у каждого потока событий свои
+    thread_local TransmitParser transmitParser;
+    thread_local std::vector<std::pair<Indicator, std::variant<int, float, bool>>> transmitSamples;
+
+    if (!transmitParser.parse(text)) {
+        return std::nullopt;
+    }
+
+    // всё сообщение проверяется до записи первого значения: если что-то не сходится,
+    // его разберёт transmitData и ответит той же ошибкой, что и раньше. Логическое
+    // значение числового показателя DOM не примет, поэтому и здесь оно не приводится
+    auto id = transmitParser.device();
+    std::shared_lock stateLock(state);
+    std::lock_guard shardLock(shard(id));
+    auto workMode = map->getWorkMode(id);
+    auto const &samples = transmitParser.samples();
+    transmitSamples.clear();
+    for (std::size_t i = 0; i < transmitParser.size(); ++i) {
+        auto indicator = capabilities->findIndicator(workMode, samples[i].name);
+        if (!indicator) {
+            return std::nullopt;
+        }
+        auto const &value = samples[i].value;
+        switch (capabilities->indicatorType(*indicator)) {
+            case DataType::Float:
+                if (std::holds_alternative<bool>(value)) {
+                    return std::nullopt;
+                }
+                transmitSamples.emplace_back(*indicator, std::visit([](auto v) {
+                    return float(v);
+                }, value));
+                break;
+            case DataType::Int:
+                if (std::holds_alternative<bool>(value)) {
+                    return std::nullopt;
+                }
+                transmitSamples.emplace_back(*indicator, std::visit([](auto v) {
+                    return int(v);
+                }, value));
+                break;
+            case DataType::Bool:
+                if (auto b = std::get_if<bool>(&value)) {
+                    transmitSamples.emplace_back(*indicator, *b);
+                } else {
+                    return std::nullopt;
+                }
+                break;
+        }
+    }
+
+    std::string const command = "transmit_data";
+    LOG(Debug, "Accepted command: " << command);
+
+    Json result;
+    try {
+        auto time = timePoint(transmitParser.time());
+        result = Json::array();
+        for (auto const &[indicator, value]: transmitSamples) {
+            std::visit([&, indicator = indicator](auto v) {
+                ingest(result, id, indicator, v, time);
+            }, value);
+        }
+    } catch (std::exception const &e) {
+        result = errorJson("", command, e.what());
+    }
+    return notify(finish(command, std::move(result)));
+}
+
+Json Commands::finish(std::string const &command, Json result) {
+    // запросы только на чтение ничего не дописали, сбрасывать нечего
+    if (journal != nullptr && isJournaled(command)) {
+        journal->commit();
+    }
 
     if (result.is_array()) {
         for (auto &r: result) {
@@ -426,6 +1083,35 @@ Json Commands::callback(Json const &json) {
     return result;
 }
 
+std::size_t Commands::replay(Journal &log, std::uint64_t generation) {
+    auto discard = [](auto &&...) {};
+    return log.replay(generation, [&](Journal::Kind kind, Journal::Reader &reader) {
+        try {
+            if (kind == Journal::Kind::Command) {
+                auto json = Json::from_cbor(reader.rest());
+                dispatch(json["command_name"].get<std::string>(), json);
+            } else if (kind == Journal::Kind::Sample) {
+                auto id = reader.get<Device>();
+                auto indicator = reader.get<Indicator>();
+                auto time = time_point(time_point::duration(reader.get<time_point::rep>()));
+                switch (capabilities->indicatorType(indicator)) {
+                    case DataType::Float:
+                        relations->transmit(discard, id, indicator, reader.get<float>(), time);
+                        break;
+                    case DataType::Int:
+                        relations->transmit(discard, id, indicator, reader.get<int>(), time);
+                        break;
+                    case DataType::Bool:
+                        relations->transmit(discard, id, indicator, reader.get<bool>(), time);
+                        break;
+                }
+            }
+        } catch (std::exception const &) {
+            // при первом выполнении команда завершилась той же ошибкой
+        }
+    });
+}
+
 Json Commands::errorJson(std::string const &from, std::string const &stage,
         const std::string &msg) {
     Json j;
@@ -445,6 +1131,18 @@ Indicator Commands::findIndicator(Device id, std::string const &name) {
     return *indicator;
 }
 
+Subscriptions::Find Commands::subscriptionIndicator() {
+    return [this](Device id, std::string const &name) {
+        return capabilities->findIndicator(map->getWorkMode(id), name);
+    };
+}
+
+Subscriptions::Locate Commands::subscriptionDevices() {
+    return [this](Subscriptions::Location const &location) {
+        return map->find(location.pattern, location.match);
+    };
+}
+
 Parameter Commands::findParameter(Device id, std::string const &name) {
     auto indicator = capabilities->findParameter(map->getWorkMode(id), name);
     if (!indicator.has_value()) {
@@ -4,6 +4,15 @@
 #include "DeviceMap.hpp"
 #include <nlohmann/json.hpp>
 #include "Relations.hpp"
+#include "Journal.hpp"
+#include "Log.hpp"
+#include "HistoryWriter.hpp"
+#include "Scheduler.hpp"
+#include "Snapshot.hpp"
+#include "ThreadPool.hpp"
+#include <mutex>
+#include <shared_mutex>
+#include "TransmitParser.hpp"
 
 using Json = nlohmann::json;
 
@@ -16,34 +25,92 @@ public:
     Commands(DeviceMap *map, Capabilities *capabilities,
             Relations *relations) : map(map), capabilities(capabilities),
             initTime(hclock::now()), relations(relations) {
+        relations->setSubscriptions(&subscriptions);
     }
 
-    Json callback(Json const &json);
+    // ответ на команду, посчитанную в пуле потоков: уже записанный текст JSON-объекта
+    using Reply = std::function<void(std::string const &)>;
+
+    // выполняет функцию на потоке событий
+    using Post = std::function<void(std::function<void()>)>;
+
+    // вызывает функцию на потоке событий, когда очередь отправки соединения освободится;
+    // если соединение закрылось, функция не вызывается
+    using Drain = std::function<void(std::function<void()>)>;
+
+    // если задан reply, тяжёлые команды (history) выполняются в пуле потоков: callback
+    // возвращает пустой ответ, а готовый результат позже передаётся в reply на потоке событий.
+    // Следующая часть ответа history частями считается только после drain
+    Json callback(Json const &json, Reply reply = {}, Drain drain = {});
+
+    // быстрый путь для transmit_data: команда разбирается прямо из текста сообщения.
+    // Пустой результат - это другая команда или сообщение, которое нужно разобрать обычным путём
+    std::optional<Json> callback(std::string_view text);
+
+    // уведомления подписок, задержанные интервалом; вызывается по таймеру.
+    // Уведомление - {"command_name": "notify", "subscriber": ..., "subscription_id": ...,
+    // "data": [{"device_id": ..., "name": ..., "time": ..., "value": ...}]}; подписчик -
+    // номер соединения, которое доставляет его дальше
+    Json callback();
+
+    void setExecutor(ThreadPool *value, Post postValue) {
+        pool = value;
+        post = std::move(postValue);
+    }
+
+    // изменяющие команды будут записываться в журнал
+    void setJournal(Journal *value) {
+        journal = value;
+    }
+
+    // проигрывает журнал поверх загруженного снимка, возвращает число записей
+    std::size_t replay(Journal &log, std::uint64_t generation);
+
+    void setSnapshots(Snapshots *value) {
+        snapshots = value;
+    }
+
+    // задачи обслуживания попадут в server_stats
+    void setScheduler(Scheduler *value) {
+        scheduler = value;
+    }
+
+    // число частей, на которые делятся устройства (по номеру); вызывается до начала работы
+    void setShards(std::size_t count) {
+        std::vector<std::mutex>(std::max<std::size_t>(count, 1)).swap(shards);
+    }
+
+    // исключительный доступ к состоянию для работы вне команд (снимки, очистка по таймеру)
+    std::unique_lock<std::shared_mutex> lockState() {
+        return std::unique_lock(state);
+    }
 
     // вызывает Relations
 
+    // out - ответ команды, в который добавляются передачи всем получателям плана;
+    // время и значение переводятся в Json один раз на значение, а не на получателя
     template<typename T>
-    void transmit(Device receiver, Parameter parameter, Timestamp<T> val) {
-        Json json;
+    void transmit(Json &out, impl::FanOut const &plan, Timestamp<T> val) {
         try {
-            json["device_id"] = receiver;
-            json["time"] = timeAndDate(val.time);
-            Json data;
-            data["name"] = capabilities->parameterName(parameter).data();
-            data["value"] = val.val;
-            json["data"].push_back(data);
+            Json const time = timeAndDate(val.time);
+            Json const value = val.val;
+            if (out.is_array()) {
+                out.get_ref<Json::array_t &>().reserve(out.size() + plan.targets.size());
+            }
+            for (auto const &t: plan.targets) {
+                Json data;
+                data["name"] = t.name;
+                data["value"] = value;
+                Json json;
+                json["device_id"] = t.receiver;
+                json["time"] = time;
+                json["data"].push_back(std::move(data));
+                out.push_back(std::move(json));
+            }
         }
         catch (std::exception const &e) {
-            std::cout << "transmit error: " << e.what() << std::endl;
-            json = errorJson(map->getPath(receiver).data(), "transmit", e.what());
-        }
-        transmitJson.push_back(json);
-    }
-
-    template<typename T>
-    void prepareHistory(std::string name, std::vector<Timestamp<T>> const &data) {
-        for (auto t: data) {
-            currentHistory[t.time][name] = t.val;
+            LOG(Error, "transmit error: " << e.what());
+            out.push_back(errorJson("", "transmit", e.what()));
         }
     }
 
@@ -51,6 +118,10 @@ public:
 
     Json transmitData(Json const &json);
 
+    // значения многих устройств одним сообщением, по столбцам для каждого показателя:
+    // {"name": ..., "device_id": [...], "time": [...] или одна строка на все, "value": [...]}
+    Json transmitBatch(Json const &json);
+
     Json history(Json const &json);
 
     Json addDeviceType(Json const &json);
@@ -75,22 +146,120 @@ public:
 
     Json setLocation(Json const &json);
 
+    // {"device_type": ..., "retention": {...}} - сроки хранения типа устройства; с "indicator"
+    // (и "work_mode") - сроки показателя. Поля retention, которых нет, не меняются
+    Json setRetention(Json const &json);
+
     Json link(Json const &json, bool unlink);
 
+    Json serverStats(Json const &json);
+
+    // {"subscriber": ..., "name": показатель, "location": ... или "device_id": [...],
+    //  "deadband": ..., "min_interval": мс}. Подписка на location следует за устройствами,
+    // которые добавляются туда, переезжают или удаляются
+    Json subscribe(Json const &json);
+
+    // "subscription_id" или "all": true - все подписки соединения
+    Json unsubscribe(Json const &json);
+
 private:
-    Json historyJson();
+    struct HistoryRequest {
+        Device id;
+        std::vector<Relations::HistoryTask> tasks;
+        std::vector<Relations::HistoryStream> streams;
+        // имена режимов, если их запрошено списком
+        std::vector<std::string> fields;
+    };
+
+    Json dispatch(std::string const &command, Json const &json);
+
+    // завершение команды: запись журнала на диск и command_name в ответе
+    Json finish(std::string const &command, Json result);
+
+    // добавляет к ответу уведомления подписок, накопленные за команду
+    Json notify(Json result);
+
+    // stream - вместо задач готовятся потоки для ответа частями
+    HistoryRequest historyRequest(Json const &json, bool stream = false);
+
+    void submitHistory(HistoryRequest request, Reply reply);
+
+    // ответ history частями: потоки рядов сливаются по времени, части идут по очереди
+    struct HistoryChunks {
+        HistoryWriter rows;
+        Device id = 0;
+        std::size_t chunkRows = 0;
+        std::size_t sequence = 0;
+        bool final = false;
+    };
+
+    static std::shared_ptr<HistoryChunks> historyChunks(HistoryRequest &request,
+            std::size_t chunkRows);
+
+    // следующая часть ответа не больше chunkRows строк
+    static std::string nextChunk(HistoryChunks &chunks);
+
+    // считает в пуле одну часть и передаёт её в reply на потоке событий; следующая
+    // часть считается, когда drain сообщит, что отправленное забрано
+    static void streamChunks(ThreadPool *pool, Post post, std::shared_ptr<HistoryChunks> chunks,
+            Reply reply, Drain drain);
+
+    // начало ответа history до массива строк
+    static void historyHead(std::string &out);
+
+    static std::string historyText(Device id, HistoryWriter &rows);
+
+    // считает все ряды запроса на вызывающем потоке
+    static HistoryWriter historyRows(HistoryRequest const &request);
+
+    template<typename T>
+    void journalSample(Device id, Indicator indicator, T val, time_point time) {
+        if (journal != nullptr) {
+            Journal::Record record(Journal::Kind::Sample);
+            record.put(id);
+            record.put(indicator);
+            record.put(time.time_since_epoch().count());
+            record.put(val);
+            journal->append(record);
+        }
+    }
+
+    template<typename T>
+    void ingest(Json &out, Device id, Indicator indicator, T val, time_point time) {
+        journalSample(id, indicator, val, time);
+        relations->transmit([this, &out](auto &&...args) { transmit(out, args...); }, id,
+                indicator, val, time);
+    }
 
     static Json errorJson(std::string const &from, std::string const &stage,
             std::string const &msg);
 
     Indicator findIndicator(Device id, std::string const& name);
 
+    std::mutex &shard(Device id) {
+        return shards[id % shards.size()];
+    }
+
     Parameter findParameter(Device id, std::string const& name);
 
+    // поиск показателей и устройств для подписок
+    Subscriptions::Find subscriptionIndicator();
+
+    Subscriptions::Locate subscriptionDevices();
+
     DeviceMap *map;
     Capabilities *capabilities;
     Relations *relations;
+    Journal *journal = nullptr;
+    Snapshots *snapshots = nullptr;
+    Scheduler *scheduler = nullptr;
+    Subscriptions subscriptions;
     time_point initTime;
-    std::map<time_point, Json> currentHistory;
-    Json transmitJson;
+    ThreadPool *pool = nullptr;
+    Post post;
+
+    // transmit_data и transmit_batch выполняются под общей блокировкой state и блокировкой
+    // части устройств, остальные команды - под исключительной блокировкой state
+    std::shared_mutex state;
+    std::vector<std::mutex> shards = std::vector<std::mutex>(1);
 };
@@ -10,6 +10,8 @@
 #include <chrono>
 #include <cereal/archives/binary.hpp>
 #include <cereal/types/vector.hpp>
+#include <cereal/types/deque.hpp>
+#include <cereal/types/array.hpp>
 #include <cereal/types/string.hpp>
 #include <cereal/types/chrono.hpp>
 #include <cereal/types/variant.hpp>
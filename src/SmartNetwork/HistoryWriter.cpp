@@ -0,0 +1,219 @@
+#include "HistoryWriter.hpp"
+#include "Commands.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+
+namespace {
+    // число в том же виде, что выводит nlohmann::json: кратчайшая запись double,
+    // у целых ".0", экспонента вне диапазона 1e-5..1e15
+    void appendFloat(std::string &out, double val) {
+        if (!std::isfinite(val)) {
+            out += "null";
+            return;
+        }
+
+        char buf[32];
+        char const *end = std::to_chars(buf, buf + sizeof(buf), val,
+                std::chars_format::scientific).ptr;
+        char const *p = buf;
+        if (*p == '-') {
+            out += '-';
+            ++p;
+        }
+
+        char digits[24];
+        int k = 0;
+        auto e = std::find(p, end, 'e');
+        for (auto q = p; q != e; ++q) {
+            if (*q != '.') {
+                digits[k++] = *q;
+            }
+        }
+        int exponent = 0;
+        std::from_chars(e + (e[1] == '+' ? 2 : 1), end, exponent);
+        int n = exponent + 1;
+
+        if (k <= n && n <= 15) {
+            out.append(digits, k);
+            out.append(n - k, '0');
+            out += ".0";
+        } else if (0 < n && n <= 15) {
+            out.append(digits, n);
+            out += '.';
+            out.append(digits + n, k - n);
+        } else if (-4 < n && n <= 0) {
+            out += "0.";
+            out.append(-n, '0');
+            out.append(digits, k);
+        } else {
+            out += digits[0];
+            if (k > 1) {
+                out += '.';
+                out.append(digits + 1, k - 1);
+            }
+            out += exponent < 0 ? "e-" : "e+";
+            auto a = std::abs(exponent);
+            if (a < 10) {
+                out += '0';
+            }
+            out += std::to_string(a);
+        }
+    }
+
+    void appendValue(std::string &out, int val) {
+        char buf[16];
+        out.append(buf, std::to_chars(buf, buf + sizeof(buf), val).ptr);
+    }
+
+    void appendValue(std::string &out, float val) {
+        appendFloat(out, val);
+    }
+
+    void appendValue(std::string &out, bool val) {
+        out += val ? "true" : "false";
+    }
+}
+
+bool HistoryWriter::Column::valid() {
+    while (!done && (batch.empty() ||
+            std::visit([](auto const &b) { return b.size(); }, batch.front()) <= index)) {
+        index = 0;
+        done = !next || !next(batch);
+    }
+    return !done;
+}
+
+time_point HistoryWriter::Column::time() const {
+    return std::visit([this](auto const &b) { return b[index].time; }, batch.front());
+}
+
+void HistoryWriter::Column::take() {
+    values.resize(batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        values[i] = std::visit([this](auto const &b) { return Value(b[index].val); }, batch[i]);
+    }
+}
+
+void HistoryWriter::Column::writeValue(std::string &out) const {
+    auto append = [&out](Value const &v) {
+        std::visit([&out](auto val) { appendValue(out, val); }, v);
+    };
+    if (fields.empty()) {
+        append(values.front());
+        return;
+    }
+
+    out += '{';
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        if (i != 0) {
+            out += ',';
+        }
+        out += fields[i].first;
+        append(values[fields[i].second]);
+    }
+    out += '}';
+}
+
+void HistoryWriter::add(std::string const &name, std::vector<std::string> const &fields,
+        Relations::HistoryColumns data) {
+    Column column{};
+    column.batch = std::move(data);
+    add(name, fields, std::move(column));
+}
+
+void HistoryWriter::add(std::string const &name, std::vector<std::string> const &fields,
+        Next next) {
+    Column column{};
+    column.next = std::move(next);
+    add(name, fields, std::move(column));
+}
+
+void HistoryWriter::add(std::string const &name, std::vector<std::string> const &fields,
+        Column column) {
+    std::vector<std::size_t> order(fields.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](auto l, auto r) { return fields[l] < fields[r]; });
+    for (auto i: order) {
+        column.fields.emplace_back(Json(fields[i]).dump() + ":", i);
+    }
+
+    names.push_back(name);
+    column.key = names.size() - 1;
+    columns.push_back(std::move(column));
+}
+
+void HistoryWriter::prepare() {
+    auto sorted = names;
+    sorted.emplace_back("time");
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    for (auto const &name: sorted) {
+        keys.push_back(Json(name).dump() + ":");
+    }
+    timeKey = std::lower_bound(sorted.begin(), sorted.end(), "time") - sorted.begin();
+    for (auto &c: columns) {
+        c.key = std::lower_bound(sorted.begin(), sorted.end(), names[c.key]) - sorted.begin();
+    }
+    cells.resize(keys.size());
+    prepared = true;
+}
+
+std::size_t HistoryWriter::write(std::string &out, std::size_t maxRows) {
+    if (!prepared) {
+        prepare();
+    }
+
+    std::size_t count = 0;
+    while (count < maxRows) {
+        std::optional<time_point> time;
+        for (auto &c: columns) {
+            if (c.valid() && (!time || c.time() < *time)) {
+                time = c.time();
+            }
+        }
+        if (!time) {
+            break;
+        }
+
+        // повторы времени внутри ряда и ряды с одинаковым именем: остаётся последнее значение
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            auto &c = columns[i];
+            while (c.valid() && c.time() == *time) {
+                c.take();
+                cells[c.key] = i;
+                ++c.index;
+            }
+        }
+
+        if (count != 0) {
+            out += ',';
+        }
+        out += '{';
+        bool first = true;
+        for (std::size_t k = 0; k < keys.size(); ++k) {
+            if (k != timeKey && !cells[k]) {
+                continue;
+            }
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+            out += keys[k];
+            if (k == timeKey) {
+                out += '"';
+                out += timeAndDate(*time);
+                out += '"';
+            } else {
+                columns[*cells[k]].writeValue(out);
+            }
+            cells[k].reset();
+        }
+        out += '}';
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Relations.hpp"
+
+// строки ответа history, записываемые сразу текстом JSON: ряды, уже упорядоченные
+// по времени, сливаются за один проход без промежуточного дерева Json.
+// Строка - объект с полями рядов в порядке имён и полем time, как у nlohmann::json
+class HistoryWriter {
+public:
+    // выдаёт следующую часть ряда, false - ряд кончился
+    using Next = std::function<bool(Relations::HistoryColumns &)>;
+
+    // ряд целиком; fields - имена столбцов ряда, тогда его значение в строке - объект
+    // {"поле": значение}, пустой fields - единственный столбец выводится просто значением
+    void add(std::string const &name, std::vector<std::string> const &fields,
+            Relations::HistoryColumns data);
+
+    // ряд, выдаваемый частями
+    void add(std::string const &name, std::vector<std::string> const &fields, Next next);
+
+    // дописывает в out через запятую не больше maxRows строк, возвращает их число;
+    // следующий вызов продолжает с места, где остановился этот
+    std::size_t write(std::string &out, std::size_t maxRows);
+
+private:
+    using Value = std::variant<int, float, bool>;
+
+    // столбцы одного ряда с общими отметками времени
+    struct Column {
+        std::size_t key;
+        Relations::HistoryColumns batch;
+        Next next;
+        // "поле": и номер его столбца, в порядке имён полей
+        std::vector<std::pair<std::string, std::size_t>> fields;
+        std::size_t index = 0;
+        bool done = false;
+        // значения последней взятой строки
+        std::vector<Value> values;
+
+        bool valid();
+
+        time_point time() const;
+
+        void take();
+
+        void writeValue(std::string &out) const;
+    };
+
+    void add(std::string const &name, std::vector<std::string> const &fields, Column column);
+
+    void prepare();
+
+    std::vector<std::string> names;
+    std::vector<Column> columns;
+    bool prepared = false;
+
+    // "имя": в порядке вывода; на месте timeKey выводится время строки
+    std::vector<std::string> keys;
+    std::size_t timeKey = 0;
+    // ряд, значение которого выводится под ключом в текущей строке
+    std::vector<std::optional<std::size_t>> cells;
+};
@@ -0,0 +1,183 @@
+#include "Journal.hpp"
+#include <array>
+#include <algorithm>
+#include <filesystem>
+#include <cctype>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+    std::uint32_t crc32(char const *data, std::size_t size) {
+        static auto const table = [] {
+            std::array<std::uint32_t, 256> t{};
+            for (std::uint32_t i = 0; i < 256; ++i) {
+                std::uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        std::uint32_t crc = 0xFFFFFFFFu;
+        for (std::size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ std::uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    void fileSync(std::FILE *file) {
+        std::fflush(file);
+#ifdef _WIN32
+        _commit(_fileno(file));
+#else
+        ::fsync(fileno(file));
+#endif
+    }
+}
+
+Journal::Journal(std::string path, std::size_t syncRecords, std::chrono::milliseconds syncInterval) :
+        path(std::move(path)), syncRecords(std::max<std::size_t>(syncRecords, 1)),
+        syncInterval(syncInterval), lastSync(std::chrono::steady_clock::now()) {
+    for (auto g: generations()) {
+        current = std::max(current, g);
+    }
+}
+
+Journal::~Journal() {
+    sync();
+    close();
+}
+
+std::vector<std::uint64_t> Journal::generations() const {
+    std::vector<std::uint64_t> result;
+    auto p = std::filesystem::absolute(path);
+    auto prefix = p.filename().string() + ".";
+    for (auto const &e: std::filesystem::directory_iterator(p.parent_path())) {
+        auto name = e.path().filename().string();
+        if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+                std::all_of(name.begin() + prefix.size(), name.end(), ::isdigit)) {
+            result.push_back(std::stoull(name.substr(prefix.size())));
+        }
+    }
+    return result;
+}
+
+std::string Journal::fileName(std::uint64_t generation) const {
+    return path + "." + std::to_string(generation);
+}
+
+void Journal::close() {
+    if (file != nullptr) {
+        std::fclose(file);
+        file = nullptr;
+    }
+}
+
+void Journal::append(Record const &record) {
+    auto const &data = record.bytes();
+    std::lock_guard lock(mutex);
+    std::uint32_t header[2] = {std::uint32_t(data.size()), crc32(data.data(), data.size())};
+    buffer.append(reinterpret_cast<char const *>(header), sizeof(header));
+    buffer += data;
+    ++unsynced;
+}
+
+void Journal::commit() {
+    std::lock_guard lock(mutex);
+    write(false);
+}
+
+void Journal::write(bool force) {
+    if (force && unsynced != 0) {
+        unsynced = syncRecords;
+    }
+    if (!buffer.empty()) {
+        if (file == nullptr) {
+            file = std::fopen(fileName(current).c_str(), "ab");
+            if (file == nullptr) {
+                throw std::runtime_error("cannot open journal '" + fileName(current) + "'");
+            }
+        }
+        std::fwrite(buffer.data(), 1, buffer.size(), file);
+        std::fflush(file);
+        buffer.clear();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (unsynced >= syncRecords || (unsynced != 0 && now - lastSync >= syncInterval)) {
+        fileSync(file);
+        unsynced = 0;
+        lastSync = now;
+    }
+}
+
+void Journal::sync() {
+    std::lock_guard lock(mutex);
+    write(true);
+}
+
+bool Journal::openRead(std::uint64_t generation) {
+    close();
+    validSize = 0;
+    file = std::fopen(fileName(generation).c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::error_code ec;
+    auto size = std::filesystem::file_size(fileName(generation), ec);
+    readSize = ec ? 0 : size;
+    return true;
+}
+
+bool Journal::read(std::uint8_t &kind, std::string &payload) {
+    std::uint32_t header[2];
+    if (std::fread(header, sizeof(header), 1, file) != 1 || header[0] == 0) {
+        return false;
+    }
+
+    // длина из повреждённого заголовка не должна выделять память под несуществующие
+    // данные: запись длиннее остатка файла - оборванный хвост
+    auto offset = std::uint64_t(std::ftell(file));
+    if (offset > readSize || header[0] > readSize - offset) {
+        return false;
+    }
+
+    std::string data(header[0], '\0');
+    if (std::fread(data.data(), 1, data.size(), file) != data.size() ||
+            crc32(data.data(), data.size()) != header[1]) {
+        return false;
+    }
+
+    kind = std::uint8_t(data[0]);
+    payload = data.substr(1);
+    validSize = std::ftell(file);
+    return true;
+}
+
+void Journal::truncateTail(std::uint64_t generation) {
+    close();
+    std::filesystem::resize_file(fileName(generation), validSize);
+}
+
+std::uint64_t Journal::rotate() {
+    std::lock_guard lock(mutex);
+    write(true);
+    close();
+    return ++current;
+}
+
+void Journal::release(std::uint64_t generation) {
+    for (auto g: generations()) {
+        if (g < generation) {
+            std::error_code ec;
+            std::filesystem::remove(fileName(g), ec);
+        }
+    }
+}
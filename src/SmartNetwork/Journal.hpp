@@ -0,0 +1,154 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// журнал предзаписи: изменяющие команды дописываются в файл до выполнения,
+// при старте журнал проигрывается поверх последнего снимка
+class Journal {
+public:
+    enum class Kind : std::uint8_t {
+        Command = 1,  // команда целиком в CBOR
+        Sample = 2,   // одно значение transmit_data или transmit_batch
+    };
+
+    // компактная двоичная запись
+    class Record {
+    public:
+        explicit Record(Kind kind) {
+            put(kind);
+        }
+
+        template<typename T>
+        void put(T val) {
+            static_assert(std::is_trivially_copyable_v<T>);
+            char bytes[sizeof(T)];
+            std::memcpy(bytes, &val, sizeof(T));
+            data.append(bytes, sizeof(T));
+        }
+
+        void put(std::string const &bytes) {
+            data += bytes;
+        }
+
+        std::string const &bytes() const {
+            return data;
+        }
+
+    private:
+        std::string data;
+    };
+
+    class Reader {
+    public:
+        explicit Reader(std::string const &data) : data(data) {}
+
+        template<typename T>
+        T get() {
+            if (pos + sizeof(T) > data.size()) {
+                throw std::runtime_error("journal record is truncated");
+            }
+            T val;
+            std::memcpy(&val, data.data() + pos, sizeof(T));
+            pos += sizeof(T);
+            return val;
+        }
+
+        std::string rest() {
+            auto r = data.substr(pos);
+            pos = data.size();
+            return r;
+        }
+
+    private:
+        std::string const &data;
+        std::size_t pos = 0;
+    };
+
+    // журнал состоит из поколений path.N; снимок хранит номер поколения, с которого
+    // начинаются ещё не вошедшие в него записи.
+    // Записи копятся в памяти и сбрасываются в файл в commit(); fsync выполняется
+    // раз в syncRecords записей или раз в syncInterval, что наступит раньше.
+    // append, commit, sync и rotate можно вызывать из разных потоков
+    explicit Journal(std::string path, std::size_t syncRecords = 256,
+            std::chrono::milliseconds syncInterval = std::chrono::seconds(1));
+
+    Journal(Journal const &) = delete;
+
+    Journal &operator=(Journal const &) = delete;
+
+    ~Journal();
+
+    void append(Record const &record);
+
+    void commit();
+
+    // сбрасывает всё накопленное на диск
+    void sync();
+
+    // вызывает f(kind, reader) для каждой целой записи поколений начиная с from;
+    // более старые поколения удаляются, повреждённый хвост отбрасывается
+    template<typename F>
+    std::size_t replay(std::uint64_t from, F &&f) {
+        release(from);
+        std::size_t count = 0;
+        for (auto g = from; g <= current; ++g) {
+            if (!openRead(g)) {
+                continue;
+            }
+            std::string payload;
+            std::uint8_t kind;
+            while (read(kind, payload)) {
+                Reader reader(payload);
+                f(Kind(kind), reader);
+                ++count;
+            }
+            truncateTail(g);
+        }
+        current = std::max(current, from);
+        return count;
+    }
+
+    // начинает новое поколение и возвращает его номер: всё записанное до этого
+    // должно войти в снимок, который сохранит этот номер
+    std::uint64_t rotate();
+
+    // удаляет поколения старше generation, вошедшие в сохранённый снимок
+    void release(std::uint64_t generation);
+
+private:
+    std::vector<std::uint64_t> generations() const;
+
+    std::string fileName(std::uint64_t generation) const;
+
+    bool openRead(std::uint64_t generation);
+
+    bool read(std::uint8_t &kind, std::string &payload);
+
+    void truncateTail(std::uint64_t generation);
+
+    void close();
+
+    // сбрасывает буфер в файл; force - сразу и fsync
+    void write(bool force);
+
+    std::mutex mutex;
+    std::string path;
+    std::uint64_t current = 0;
+    std::FILE *file = nullptr;
+    std::string buffer;
+    long validSize = 0;
+    // размер читаемого поколения: с ним сверяются длины записей
+    std::uint64_t readSize = 0;
+    std::size_t syncRecords;
+    std::chrono::milliseconds syncInterval;
+    std::size_t unsynced = 0;
+    std::chrono::steady_clock::time_point lastSync;
+};
@@ -0,0 +1,362 @@
+#include "Kernels.hpp"
+#include <algorithm>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SMART_NETWORK_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace impl::kernels {
+    namespace {
+        template<typename T>
+        T minScalar(T const *data, std::size_t size) {
+            return *std::min_element(data, data + size);
+        }
+
+        template<typename T>
+        T maxScalar(T const *data, std::size_t size) {
+            return *std::max_element(data, data + size);
+        }
+
+        template<typename T>
+        double sumScalar(T const *data, std::size_t size) {
+            double res = 0;
+            for (std::size_t i = 0; i < size; ++i) {
+                res += data[i];
+            }
+            return res;
+        }
+
+        bool anyScalar(std::uint8_t const *data, std::size_t size) {
+            return std::find(data, data + size, 1) != data + size;
+        }
+
+        bool allScalar(std::uint8_t const *data, std::size_t size) {
+            return std::find(data, data + size, 0) == data + size;
+        }
+
+#ifdef SMART_NETWORK_X86_KERNELS
+        // AVX2: по 8 значений int/float и по 32 значения bool за итерацию
+
+        __attribute__((target("avx2")))
+        int minIntAvx2(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256i acc = _mm256_set1_epi32(std::numeric_limits<int>::max());
+            for (; i + 8 <= size; i += 8) {
+                acc = _mm256_min_epi32(acc, _mm256_loadu_si256((__m256i const *) (data + i)));
+            }
+            alignas(32) int lanes[8];
+            _mm256_store_si256((__m256i *) lanes, acc);
+            int res = *std::min_element(lanes, lanes + 8);
+            for (; i < size; ++i) {
+                res = std::min(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("avx2")))
+        int maxIntAvx2(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256i acc = _mm256_set1_epi32(std::numeric_limits<int>::min());
+            for (; i + 8 <= size; i += 8) {
+                acc = _mm256_max_epi32(acc, _mm256_loadu_si256((__m256i const *) (data + i)));
+            }
+            alignas(32) int lanes[8];
+            _mm256_store_si256((__m256i *) lanes, acc);
+            int res = *std::max_element(lanes, lanes + 8);
+            for (; i < size; ++i) {
+                res = std::max(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("avx2")))
+        float minFloatAvx2(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256 acc = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+            for (; i + 8 <= size; i += 8) {
+                acc = _mm256_min_ps(acc, _mm256_loadu_ps(data + i));
+            }
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, acc);
+            float res = *std::min_element(lanes, lanes + 8);
+            for (; i < size; ++i) {
+                res = std::min(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("avx2")))
+        float maxFloatAvx2(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256 acc = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+            for (; i + 8 <= size; i += 8) {
+                acc = _mm256_max_ps(acc, _mm256_loadu_ps(data + i));
+            }
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, acc);
+            float res = *std::max_element(lanes, lanes + 8);
+            for (; i < size; ++i) {
+                res = std::max(res, data[i]);
+            }
+            return res;
+        }
+
+        // целые суммируются точно в 64-битных ячейках
+        __attribute__((target("avx2")))
+        double sumIntAvx2(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256i lo = _mm256_setzero_si256();
+            __m256i hi = _mm256_setzero_si256();
+            for (; i + 8 <= size; i += 8) {
+                __m256i v = _mm256_loadu_si256((__m256i const *) (data + i));
+                lo = _mm256_add_epi64(lo, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+                hi = _mm256_add_epi64(hi, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+            }
+            alignas(32) long long lanes[4];
+            _mm256_store_si256((__m256i *) lanes, _mm256_add_epi64(lo, hi));
+            long long res = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            for (; i < size; ++i) {
+                res += data[i];
+            }
+            return double(res);
+        }
+
+        // вещественные суммируются в double, как и в свёртках
+        __attribute__((target("avx2")))
+        double sumFloatAvx2(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256d lo = _mm256_setzero_pd();
+            __m256d hi = _mm256_setzero_pd();
+            for (; i + 8 <= size; i += 8) {
+                __m256 v = _mm256_loadu_ps(data + i);
+                lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+                hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+            }
+            alignas(32) double lanes[4];
+            _mm256_store_pd(lanes, _mm256_add_pd(lo, hi));
+            double res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            for (; i < size; ++i) {
+                res += data[i];
+            }
+            return res;
+        }
+
+        __attribute__((target("avx2")))
+        bool anyAvx2(std::uint8_t const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256i acc = _mm256_setzero_si256();
+            for (; i + 32 <= size; i += 32) {
+                acc = _mm256_or_si256(acc, _mm256_loadu_si256((__m256i const *) (data + i)));
+            }
+            return !_mm256_testz_si256(acc, acc) || anyScalar(data + i, size - i);
+        }
+
+        __attribute__((target("avx2")))
+        bool allAvx2(std::uint8_t const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m256i acc = _mm256_set1_epi8(1);
+            for (; i + 32 <= size; i += 32) {
+                acc = _mm256_min_epu8(acc, _mm256_loadu_si256((__m256i const *) (data + i)));
+            }
+            __m256i zero = _mm256_cmpeq_epi8(acc, _mm256_setzero_si256());
+            return _mm256_testz_si256(zero, zero) && allScalar(data + i, size - i);
+        }
+
+        // SSE4.1: по 4 значения int/float и по 16 значений bool за итерацию
+
+        __attribute__((target("sse4.1")))
+        int minIntSse(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128i acc = _mm_set1_epi32(std::numeric_limits<int>::max());
+            for (; i + 4 <= size; i += 4) {
+                acc = _mm_min_epi32(acc, _mm_loadu_si128((__m128i const *) (data + i)));
+            }
+            alignas(16) int lanes[4];
+            _mm_store_si128((__m128i *) lanes, acc);
+            int res = *std::min_element(lanes, lanes + 4);
+            for (; i < size; ++i) {
+                res = std::min(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("sse4.1")))
+        int maxIntSse(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128i acc = _mm_set1_epi32(std::numeric_limits<int>::min());
+            for (; i + 4 <= size; i += 4) {
+                acc = _mm_max_epi32(acc, _mm_loadu_si128((__m128i const *) (data + i)));
+            }
+            alignas(16) int lanes[4];
+            _mm_store_si128((__m128i *) lanes, acc);
+            int res = *std::max_element(lanes, lanes + 4);
+            for (; i < size; ++i) {
+                res = std::max(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("sse4.1")))
+        float minFloatSse(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128 acc = _mm_set1_ps(std::numeric_limits<float>::infinity());
+            for (; i + 4 <= size; i += 4) {
+                acc = _mm_min_ps(acc, _mm_loadu_ps(data + i));
+            }
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, acc);
+            float res = *std::min_element(lanes, lanes + 4);
+            for (; i < size; ++i) {
+                res = std::min(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("sse4.1")))
+        float maxFloatSse(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128 acc = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+            for (; i + 4 <= size; i += 4) {
+                acc = _mm_max_ps(acc, _mm_loadu_ps(data + i));
+            }
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, acc);
+            float res = *std::max_element(lanes, lanes + 4);
+            for (; i < size; ++i) {
+                res = std::max(res, data[i]);
+            }
+            return res;
+        }
+
+        __attribute__((target("sse4.1")))
+        double sumIntSse(int const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128i lo = _mm_setzero_si128();
+            __m128i hi = _mm_setzero_si128();
+            for (; i + 4 <= size; i += 4) {
+                __m128i v = _mm_loadu_si128((__m128i const *) (data + i));
+                lo = _mm_add_epi64(lo, _mm_cvtepi32_epi64(v));
+                hi = _mm_add_epi64(hi, _mm_cvtepi32_epi64(_mm_unpackhi_epi64(v, v)));
+            }
+            alignas(16) long long lanes[2];
+            _mm_store_si128((__m128i *) lanes, _mm_add_epi64(lo, hi));
+            long long res = lanes[0] + lanes[1];
+            for (; i < size; ++i) {
+                res += data[i];
+            }
+            return double(res);
+        }
+
+        __attribute__((target("sse4.1")))
+        double sumFloatSse(float const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128d lo = _mm_setzero_pd();
+            __m128d hi = _mm_setzero_pd();
+            for (; i + 4 <= size; i += 4) {
+                __m128 v = _mm_loadu_ps(data + i);
+                lo = _mm_add_pd(lo, _mm_cvtps_pd(v));
+                hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+            }
+            alignas(16) double lanes[2];
+            _mm_store_pd(lanes, _mm_add_pd(lo, hi));
+            double res = lanes[0] + lanes[1];
+            for (; i < size; ++i) {
+                res += data[i];
+            }
+            return res;
+        }
+
+        __attribute__((target("sse4.1")))
+        bool anySse(std::uint8_t const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128i acc = _mm_setzero_si128();
+            for (; i + 16 <= size; i += 16) {
+                acc = _mm_or_si128(acc, _mm_loadu_si128((__m128i const *) (data + i)));
+            }
+            return !_mm_testz_si128(acc, acc) || anyScalar(data + i, size - i);
+        }
+
+        __attribute__((target("sse4.1")))
+        bool allSse(std::uint8_t const *data, std::size_t size) {
+            std::size_t i = 0;
+            __m128i acc = _mm_set1_epi8(1);
+            for (; i + 16 <= size; i += 16) {
+                acc = _mm_min_epu8(acc, _mm_loadu_si128((__m128i const *) (data + i)));
+            }
+            __m128i zero = _mm_cmpeq_epi8(acc, _mm_setzero_si128());
+            return _mm_testz_si128(zero, zero) && allScalar(data + i, size - i);
+        }
+#endif
+
+        struct Table {
+            char const *isa;
+            int (*minInt)(int const *, std::size_t);
+            float (*minFloat)(float const *, std::size_t);
+            int (*maxInt)(int const *, std::size_t);
+            float (*maxFloat)(float const *, std::size_t);
+            double (*sumInt)(int const *, std::size_t);
+            double (*sumFloat)(float const *, std::size_t);
+            bool (*any)(std::uint8_t const *, std::size_t);
+            bool (*all)(std::uint8_t const *, std::size_t);
+        };
+
+        Table select() {
+#ifdef SMART_NETWORK_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return {"avx2", minIntAvx2, minFloatAvx2, maxIntAvx2, maxFloatAvx2,
+                        sumIntAvx2, sumFloatAvx2, anyAvx2, allAvx2};
+            }
+            if (__builtin_cpu_supports("sse4.1")) {
+                return {"sse4.1", minIntSse, minFloatSse, maxIntSse, maxFloatSse,
+                        sumIntSse, sumFloatSse, anySse, allSse};
+            }
+#endif
+            return {"scalar", minScalar<int>, minScalar<float>, maxScalar<int>, maxScalar<float>,
+                    sumScalar<int>, sumScalar<float>, anyScalar, allScalar};
+        }
+
+        Table const &table() {
+            static Table const t = select();
+            return t;
+        }
+    }
+
+    int min(int const *data, std::size_t size) {
+        return table().minInt(data, size);
+    }
+
+    float min(float const *data, std::size_t size) {
+        return table().minFloat(data, size);
+    }
+
+    int max(int const *data, std::size_t size) {
+        return table().maxInt(data, size);
+    }
+
+    float max(float const *data, std::size_t size) {
+        return table().maxFloat(data, size);
+    }
+
+    double sum(int const *data, std::size_t size) {
+        return table().sumInt(data, size);
+    }
+
+    double sum(float const *data, std::size_t size) {
+        return table().sumFloat(data, size);
+    }
+
+    bool any(std::uint8_t const *data, std::size_t size) {
+        return table().any(data, size);
+    }
+
+    bool all(std::uint8_t const *data, std::size_t size) {
+        return table().all(data, size);
+    }
+
+    char const *isa() {
+        return table().isa;
+    }
+}
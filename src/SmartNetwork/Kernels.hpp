@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// агрегаты над непрерывными массивами значений; реализация (AVX2, SSE4.1 или скалярная)
+// выбирается один раз при запуске по возможностям процессора
+namespace impl::kernels {
+    int min(int const *data, std::size_t size);
+
+    float min(float const *data, std::size_t size);
+
+    int max(int const *data, std::size_t size);
+
+    float max(float const *data, std::size_t size);
+
+    double sum(int const *data, std::size_t size);
+
+    double sum(float const *data, std::size_t size);
+
+    bool any(std::uint8_t const *data, std::size_t size);
+
+    bool all(std::uint8_t const *data, std::size_t size);
+
+    // название выбранного набора инструкций
+    char const *isa();
+}
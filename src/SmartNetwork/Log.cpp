@@ -0,0 +1,205 @@
+#include "Log.hpp"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+std::atomic<Log::Level> Log::threshold{Log::Level::Info};
+std::atomic<unsigned> Log::payloadRate{10};
+
+namespace {
+    // ограниченная очередь на много писателей и одного читателя: каждая ячейка хранит номер
+    // записи, которую в неё можно положить или из неё взять, поэтому блокировки не нужны
+    class Ring {
+    public:
+        explicit Ring(std::size_t capacity) {
+            std::size_t size = 2;
+            while (size < capacity) {
+                size *= 2;
+            }
+            slots = std::make_unique<Slot[]>(size);
+            mask = size - 1;
+            for (std::size_t i = 0; i < size; ++i) {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        bool push(std::string &text) {
+            auto pos = head.load(std::memory_order_relaxed);
+            Slot *slot;
+            while (true) {
+                slot = &slots[pos & mask];
+                auto seq = slot->sequence.load(std::memory_order_acquire);
+                auto diff = std::intptr_t(seq) - std::intptr_t(pos);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+            slot->text = std::move(text);
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // только из потока вывода
+        bool pop(std::string &text) {
+            auto &slot = slots[tail & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != tail + 1) {
+                return false;
+            }
+            text = std::move(slot.text);
+            slot.sequence.store(tail + mask + 1, std::memory_order_release);
+            ++tail;
+            return true;
+        }
+
+    private:
+        struct Slot {
+            std::atomic<std::size_t> sequence;
+            std::string text;
+        };
+
+        std::unique_ptr<Slot[]> slots;
+        std::size_t mask = 0;
+        std::atomic<std::size_t> head{0};
+        std::size_t tail = 0;
+    };
+
+    // буфер не удаляется до выхода из программы: писатель мог взять его перед остановкой
+    std::unique_ptr<Ring> buffer;
+    std::atomic<Ring *> active{nullptr};
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+    std::mutex console;
+
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<std::uint64_t> skipped{0};
+    std::atomic<std::int64_t> payloadSecond{0};
+    std::atomic<unsigned> payloadCount{0};
+
+    char const *levelName(Log::Level level) {
+        switch (level) {
+        case Log::Level::Debug:
+            return "[debug] ";
+        case Log::Level::Info:
+            return "[info] ";
+        case Log::Level::Warning:
+            return "[warning] ";
+        case Log::Level::Error:
+            return "[error] ";
+        default:
+            return "";
+        }
+    }
+
+    void report() {
+        if (auto n = dropped.exchange(0, std::memory_order_relaxed)) {
+            std::cout << "[warning] log buffer overflow, dropped " << n << " messages" << '\n';
+        }
+        if (auto n = skipped.exchange(0, std::memory_order_relaxed)) {
+            std::cout << "[warning] payload logging rate exceeded, skipped " << n << " messages"
+                    << '\n';
+        }
+    }
+
+    void run(Ring &ring) {
+        using namespace std::chrono;
+        std::string text;
+        auto reported = steady_clock::now();
+        while (true) {
+            // флаг читается до разбора буфера: всё записанное до остановки будет выведено
+            bool last = stopping.load(std::memory_order_acquire);
+            bool any = false;
+            {
+                std::lock_guard lock(console);
+                while (ring.pop(text)) {
+                    std::cout << text << '\n';
+                    any = true;
+                }
+                auto now = steady_clock::now();
+                if (last || now - reported >= seconds(1)) {
+                    report();
+                    reported = now;
+                }
+                std::cout.flush();
+            }
+            if (last) {
+                return;
+            }
+            if (!any) {
+                std::this_thread::sleep_for(milliseconds(5));
+            }
+        }
+    }
+}
+
+std::optional<Log::Level> Log::parseLevel(std::string const &name) {
+    if (name == "debug") {
+        return Level::Debug;
+    } else if (name == "info") {
+        return Level::Info;
+    } else if (name == "warning") {
+        return Level::Warning;
+    } else if (name == "error") {
+        return Level::Error;
+    } else if (name == "off") {
+        return Level::Off;
+    }
+    return std::nullopt;
+}
+
+bool Log::samplePayload() {
+    auto rate = payloadRate.load(std::memory_order_relaxed);
+    auto second = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto current = payloadSecond.load(std::memory_order_relaxed);
+    if (current != second &&
+            payloadSecond.compare_exchange_strong(current, second, std::memory_order_relaxed)) {
+        payloadCount.store(0, std::memory_order_relaxed);
+    }
+    if (payloadCount.fetch_add(1, std::memory_order_relaxed) < rate) {
+        return true;
+    }
+    skipped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// уровень дописывается в начало строки здесь, а не в макросе: вызывающий код
+// собирает только текст сообщения
+void Log::write(Level level, std::string text) {
+    text.insert(0, levelName(level));
+    if (auto ring = active.load(std::memory_order_acquire)) {
+        if (!ring->push(text)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    std::lock_guard lock(console);
+    std::cout << text << std::endl;
+}
+
+Log::Writer::Writer(std::size_t capacity) {
+    if (active.load()) {
+        throw std::runtime_error("log writer is already running");
+    }
+    // после остановки прежнего потока его буфер пуст и используется снова
+    if (!buffer) {
+        buffer = std::make_unique<Ring>(capacity);
+    }
+    stopping.store(false);
+    writer = std::thread(run, std::ref(*buffer));
+    active.store(buffer.get(), std::memory_order_release);
+}
+
+Log::Writer::~Writer() {
+    active.store(nullptr, std::memory_order_release);
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+
+// журнал работы с уровнями: сообщения кладутся в кольцевой буфер без блокировок,
+// а на консоль их выводит отдельный поток. Пока поток не запущен, сообщения
+// выводятся сразу. Текст сообщения собирается, только если его уровень включён:
+//   LOG(Info, "Loading data... " << bytes);
+class Log {
+public:
+    enum class Level : int {
+        Debug,
+        Info,
+        Warning,
+        Error,
+        Off,
+    };
+
+    static std::optional<Level> parseLevel(std::string const &name);
+
+    static bool enabled(Level level) {
+        return level >= threshold.load(std::memory_order_relaxed);
+    }
+
+    static void setLevel(Level level) {
+        threshold.store(level, std::memory_order_relaxed);
+    }
+
+    // не больше perSecond сообщений с содержимым пакетов в секунду, остальные пропускаются
+    static void setPayloadRate(unsigned perSecond) {
+        payloadRate.store(perSecond, std::memory_order_relaxed);
+    }
+
+    // можно ли сейчас вывести ещё одно сообщение с содержимым пакета
+    static bool samplePayload();
+
+    // если буфер полон, сообщение отбрасывается; число отброшенных выводится позже
+    static void write(Level level, std::string text);
+
+    // поток вывода, работает, пока существует объект; при удалении дописывает буфер
+    class Writer {
+    public:
+        // capacity - число сообщений в буфере, округляется вверх до степени двойки
+        explicit Writer(std::size_t capacity = 8192);
+
+        Writer(Writer const &) = delete;
+
+        Writer &operator=(Writer const &) = delete;
+
+        ~Writer();
+    };
+
+private:
+    static std::atomic<Level> threshold;
+    static std::atomic<unsigned> payloadRate;
+};
+
+#define LOG(level, message) \
+    do { \
+        if (Log::enabled(Log::Level::level)) { \
+            std::ostringstream logStream_; \
+            logStream_ << message; \
+            Log::write(Log::Level::level, logStream_.str()); \
+        } \
+    } while (false)
+
+// сообщение с содержимым пакета, выводится с ограничением частоты
+#define LOG_PAYLOAD(level, message) \
+    do { \
+        if (Log::enabled(Log::Level::level) && Log::samplePayload()) { \
+            std::ostringstream logStream_; \
+            logStream_ << message; \
+            Log::write(Log::Level::level, logStream_.str()); \
+        } \
+    } while (false)
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+
+using Json = nlohmann::json;
+
+// кодировка сообщений соединения: по умолчанию текст JSON, по договорённости -
+// двоичные CBOR или MessagePack в двоичных кадрах
+enum class Encoding {
+    Json,
+    Cbor,
+    MsgPack,
+};
+
+// имя кодировки, оно же имя подпротокола websocket
+inline std::optional<Encoding> parseEncoding(std::string const &name) {
+    if (name == "json") {
+        return Encoding::Json;
+    } else if (name == "cbor") {
+        return Encoding::Cbor;
+    } else if (name == "msgpack") {
+        return Encoding::MsgPack;
+    }
+    return std::nullopt;
+}
+
+inline char const *encodingName(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::Cbor:
+            return "cbor";
+        case Encoding::MsgPack:
+            return "msgpack";
+        default:
+            return "json";
+    }
+}
+
+inline bool isBinary(Encoding encoding) {
+    return encoding != Encoding::Json;
+}
+
+// текстовые кадры всегда JSON; двоичные - в кодировке соединения, CBOR, если она не выбрана
+inline Json decode(std::string const &payload, bool binary, Encoding encoding) {
+    if (!binary) {
+        return Json::parse(payload);
+    }
+    if (encoding == Encoding::MsgPack) {
+        return Json::from_msgpack(payload);
+    }
+    return Json::from_cbor(payload);
+}
+
+inline std::string encode(Json const &json, Encoding encoding) {
+    std::string out;
+    switch (encoding) {
+        case Encoding::Cbor:
+            Json::to_cbor(json, out);
+            break;
+        case Encoding::MsgPack:
+            Json::to_msgpack(json, out);
+            break;
+        default:
+            out = json.dump();
+            break;
+    }
+    return out;
+}
+
+// уже записанный текст JSON (ответы из пула потоков) в кодировке соединения
+inline std::string encode(std::string const &text, Encoding encoding) {
+    if (!isBinary(encoding)) {
+        return text;
+    }
+    return encode(Json::parse(text), encoding);
+}
+
+// элементы ответов, которые уйдут одним кадром-массивом: каждый кодируется сразу,
+// а заголовок массива дописывается при отправке
+struct Batch {
+    std::string items;
+    std::size_t count = 0;
+    Encoding encoding = Encoding::Json;
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    void add(Json const &item) {
+        switch (encoding) {
+            case Encoding::Cbor:
+                Json::to_cbor(item, items);
+                break;
+            case Encoding::MsgPack:
+                Json::to_msgpack(item, items);
+                break;
+            default:
+                if (count != 0) {
+                    items += ',';
+                }
+                items += item.dump();
+                break;
+        }
+        ++count;
+    }
+
+    // элементы уже записанного текстом массива JSON
+    void addText(std::string const &array) {
+        if (isBinary(encoding)) {
+            for (auto const &item: Json::parse(array)) {
+                add(item);
+            }
+            return;
+        }
+        auto begin = array.find('[');
+        auto end = array.rfind(']');
+        if (begin == std::string::npos || end == std::string::npos ||
+                array.find_first_not_of(" \t\r\n", begin + 1) == end) {
+            return;
+        }
+        if (count != 0) {
+            items += ',';
+        }
+        items.append(array, begin + 1, end - begin - 1);
+        ++count;
+    }
+
+    // элементы другого пакета в той же кодировке
+    void merge(Batch &&other) {
+        if (other.empty()) {
+            return;
+        }
+        if (count != 0 && !isBinary(encoding)) {
+            items += ',';
+        }
+        items += other.items;
+        count += other.count;
+        other.items.clear();
+        other.count = 0;
+    }
+
+    // кадр с массивом элементов; пакет становится пустым
+    std::string take() {
+        std::string out;
+        switch (encoding) {
+            case Encoding::Cbor:
+                // массив неопределённой длины: число элементов не нужно заранее
+                out.reserve(items.size() + 2);
+                out += char(0x9f);
+                out += items;
+                out += char(0xff);
+                break;
+            case Encoding::MsgPack:
+                out.reserve(items.size() + 5);
+                if (count < 16) {
+                    out += char(0x90 | count);
+                } else if (count <= 0xffff) {
+                    out += char(0xdc);
+                    out += char(count >> 8);
+                    out += char(count);
+                } else {
+                    out += char(0xdd);
+                    for (int shift = 24; shift >= 0; shift -= 8) {
+                        out += char(count >> shift);
+                    }
+                }
+                out += items;
+                break;
+            default:
+                out.reserve(items.size() + 2);
+                out += '[';
+                out += items;
+                out += ']';
+                break;
+        }
+        items.clear();
+        count = 0;
+        return out;
+    }
+};
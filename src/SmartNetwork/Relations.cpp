@@ -1,8 +1,11 @@
 #include "Relations.hpp"
+#include <limits>
 #include <numeric>
+#include <functional>
 
 void Relations::link(Device transmitter, Indicator indicator,
         Device receiver, Parameter parameter) {
+    invalidateFanOut();
 
     impl::TransmitData transmitData = {transmitter, indicator, map->getWorkMode(transmitter)};
     impl::ReceiveData receiveData = {receiver, parameter, map->getWorkMode(receiver)};
@@ -26,6 +29,7 @@ void Relations::link(Device transmitter, Indicator indicator,
 
         tit = storage.insert({transmitData, {receiveData}}).first;
         tit->first.data = std::make_shared<impl::Storage>(std::move(s));
+        configure(tit->first);
     } else {
         if (std::find(tit->second.begin(), tit->second.end(), receiveData) == tit->second.end()) {
             tit->second.push_back(receiveData);
@@ -46,6 +50,7 @@ void Relations::link(Device transmitter, Indicator indicator,
 
 void Relations::unlink(Device transmitter, Indicator indicator,
         Device receiver, Parameter parameter) {
+    invalidateFanOut();
     impl::TransmitData transmitData = {transmitter, indicator, map->getWorkMode(transmitter)};
     impl::ReceiveData receiveData = {receiver, parameter, map->getWorkMode(receiver)};
     auto tit = storage.find(transmitData);
@@ -68,7 +73,527 @@ void Relations::unlink(Device transmitter, Indicator indicator,
     }
 }
 
+impl::FanOut const &Relations::fanOut(
+        std::pair<impl::TransmitData const, std::vector<impl::ReceiveData>> const &entry) {
+    auto &plan = entry.first.fanOut;
+    if (plan && plan->generation == fanOutGeneration) {
+        return *plan;
+    }
+    auto built = std::make_shared<impl::FanOut>();
+    built->generation = fanOutGeneration;
+    for (auto const &r: entry.second) {
+        if (map->getReceiveInstantly(r.receiver) && map->getWorkMode(r.receiver) == r.workMode) {
+            built->targets.push_back({r.receiver, r.parameter,
+                    std::string(capabilities->parameterName(r.parameter))});
+        }
+    }
+    plan = std::move(built);
+    return *plan;
+}
+
+namespace {
+    // настройки ряда из описания его индикатора
+    struct SeriesSettings {
+        Retention retention;
+        bool quantiles = false;
+    };
+
+    // сколько интервалов или исходных значений поток истории выдаёт за раз
+    constexpr std::size_t streamBatch = 4096;
+
+    // запрос истории по согласованным представлениям рядов одного типа
+    template<typename S>
+    struct SeriesQuery {
+        using T = typename S::value_type;
+        using Columns = std::vector<std::vector<Timestamp<T>>>;
+
+        std::vector<S> views;
+        time_point from;
+        time_point to;
+        seconds interval;
+        std::vector<ApproxMode> approxModes;
+        bool aggregateSources;
+
+        // история промежутка [from, to] по столбцу на каждый режим
+        Columns compute(time_point from, time_point to) const {
+            // каждый параметр может зависеть от нескольких передающих устройств,
+            // их уже отсортированные данные сливаются без общей сортировки
+            if (interval == seconds(0)) {
+                Columns result(1);
+                std::vector<typename S::Cursor> cursors;
+                for (auto const &v: views) {
+                    cursors.emplace_back(v, from, to);
+                }
+                impl::merge(cursors, [](auto const &c) { return c.time(); },
+                        [&result](auto const &c) { result[0].push_back({c.value(), c.time()}); });
+                return result;
+            }
+
+            // интервал считается один раз со всеми агрегатами, из него берутся все режимы
+            Columns result(approxModes.size());
+            auto emit = [&](impl::Bucket<T> const &bucket) {
+                for (std::size_t m = 0; m < approxModes.size(); ++m) {
+                    result[m].push_back({bucket.value(approxModes[m]), bucket.start});
+                }
+            };
+
+            bool const digests = impl::needsDigests(approxModes);
+            std::vector<std::vector<impl::Bucket<T>>> sources(views.size());
+            std::vector<impl::VectorCursor<impl::Bucket<T>>> cursors;
+            for (std::size_t i = 0; i < sources.size(); ++i) {
+                impl::buckets(sources[i], views[i], from, to, interval, digests);
+                cursors.push_back({sources[i].begin(), sources[i].end()});
+            }
+
+            if (!aggregateSources) {
+                impl::merge(cursors, [](auto const &c) { return c.it->start; },
+                        [&](auto const &c) { emit(*c.it); });
+                return result;
+            }
+
+            std::optional<impl::Bucket<T>> bucket;
+            impl::merge(cursors, [](auto const &c) { return c.it->start; },
+                    [&](auto const &c) {
+                        if (bucket && bucket->start != c.it->start) {
+                            emit(*bucket);
+                            bucket.reset();
+                        }
+                        if (bucket) {
+                            bucket->merge(*c.it, digests);
+                        } else {
+                            bucket = *c.it;
+                        }
+                    });
+            if (bucket) {
+                emit(*bucket);
+            }
+            return result;
+        }
+
+        // выдаёт историю частями не больше streamBatch значений: с интервалом - окнами
+        // из streamBatch интервалов, выровненными по их границам, без интервала - слиянием
+        // курсоров, которое продолжается с места, где остановилась прошлая часть
+        std::function<bool(Relations::HistoryColumns &)> stream() && {
+            auto query = std::make_shared<SeriesQuery>(std::move(*this));
+            if (query->interval == seconds(0)) {
+                // куча слияния живёт между частями, как и курсоры
+                auto key = [](auto const &c) { return c.time(); };
+                struct Raw {
+                    std::vector<typename S::Cursor> cursors;
+                    std::optional<impl::Merge<typename S::Cursor, decltype(key)>> merge;
+                };
+                auto raw = std::make_shared<Raw>();
+                for (auto const &v: query->views) {
+                    raw->cursors.emplace_back(v, query->from, query->to);
+                }
+                raw->merge.emplace(raw->cursors, key);
+                return [query, raw](Relations::HistoryColumns &batch) {
+                    std::vector<Timestamp<T>> result;
+                    raw->merge->take([&result](auto const &c) {
+                        result.push_back({c.value(), c.time()});
+                    }, streamBatch);
+                    if (result.empty()) {
+                        return false;
+                    }
+                    batch.assign(1, std::move(result));
+                    return true;
+                };
+            }
+
+            if (query->to < query->from) {
+                return [](Relations::HistoryColumns &) { return false; };
+            }
+            // окно - не больше streamBatch интервалов и не больше, чем покрывает [from, to];
+            // считается в отсчётах time_point, чтобы ни окно, ни сдвиги на него ниже
+            // не переполнились
+            using Rep = time_point::rep;
+            auto const step = std::chrono::duration_cast<time_point::duration>(
+                    query->interval).count();
+            auto const span = std::uint64_t(query->to.time_since_epoch().count()) -
+                    std::uint64_t(query->from.time_since_epoch().count());
+            auto const limit = std::uint64_t(std::numeric_limits<Rep>::max() / step - 2);
+            auto const count = std::min({std::uint64_t(streamBatch), span / step + 1, limit});
+            auto const window = time_point::duration(Rep(count) * step);
+            auto const tick = time_point::duration(1);
+            auto next = std::max(query->from, time_point::min() + window + 2 * query->interval);
+            auto const to = std::min(query->to, time_point::max() - window - 2 * query->interval);
+            return [query, next, to, window, tick](Relations::HistoryColumns &batch) mutable {
+                while (next <= to) {
+                    auto end = std::min(impl::floorTime(next, query->interval) + window - tick, to);
+                    auto result = query->compute(next, end);
+                    next = end + tick;
+                    if (!result.front().empty()) {
+                        batch.assign(std::make_move_iterator(result.begin()),
+                                std::make_move_iterator(result.end()));
+                        return true;
+                    }
+                }
+                return false;
+            };
+        }
+    };
+
+    // f получает запрос по рядам sources, тип которых определяется первым из них
+    template<typename F>
+    void withQuery(std::vector<std::shared_ptr<impl::Storage>> const &sources, time_point from,
+            time_point to, seconds interval, std::vector<ApproxMode> const &approxModes,
+            bool aggregateSources, F &&f) {
+        std::visit([&](auto const &front) {
+            using S = std::decay_t<decltype(front)>;
+            SeriesQuery<S> query{{}, from, to, interval, approxModes, aggregateSources};
+            bool const digests = impl::needsDigests(approxModes);
+            for (auto const &s: sources) {
+                query.views.push_back(std::get<S>(*s).view(from, to, interval, digests));
+            }
+            f(std::move(query));
+        }, *sources.front());
+    }
+}
+
+std::vector<std::shared_ptr<impl::Storage>> Relations::parameterSources(Device receiver,
+        Parameter parameter) const {
+    impl::ReceiveData receiveData{receiver, parameter, map->getWorkMode(receiver)};
+    auto it = receiveDependencies.find(receiveData);
+    if (it == receiveDependencies.end()) {
+        return {};
+    }
+    for (auto const &s: it->second) {
+        ensureLoaded(s.get());
+    }
+    return it->second;
+}
+
+std::vector<std::shared_ptr<impl::Storage>> Relations::indicatorSources(Device device,
+        Indicator indicator) const {
+    impl::TransmitData transmitData{device, indicator, map->getWorkMode(device)};
+    auto it = storage.find(transmitData);
+    if (it == storage.end()) {
+        return {};
+    }
+    ensureLoaded(it->first.data.get());
+    return {it->first.data};
+}
+
+std::optional<Relations::HistoryTask> Relations::parameterHistoryTask(Device receiver,
+        Parameter parameter, time_point from, time_point to, seconds discreteInterval,
+        std::vector<ApproxMode> const &approxModes, bool aggregateSources) {
+    return historyTask(capabilities->parameterName(parameter).data(),
+            parameterSources(receiver, parameter), from, to, discreteInterval, approxModes,
+            aggregateSources);
+}
+
+std::optional<Relations::HistoryTask> Relations::indicatorHistoryTask(Device device,
+        Indicator indicator, time_point from, time_point to, seconds discreteInterval,
+        std::vector<ApproxMode> const &approxModes) {
+    return historyTask(capabilities->indicatorName(indicator).data(),
+            indicatorSources(device, indicator), from, to, discreteInterval, approxModes, false);
+}
+
+std::optional<Relations::HistoryStream> Relations::parameterHistoryStream(Device receiver,
+        Parameter parameter, time_point from, time_point to, seconds discreteInterval,
+        std::vector<ApproxMode> const &approxModes, bool aggregateSources) {
+    return historyStream(capabilities->parameterName(parameter).data(),
+            parameterSources(receiver, parameter), from, to, discreteInterval, approxModes,
+            aggregateSources);
+}
+
+std::optional<Relations::HistoryStream> Relations::indicatorHistoryStream(Device device,
+        Indicator indicator, time_point from, time_point to, seconds discreteInterval,
+        std::vector<ApproxMode> const &approxModes) {
+    return historyStream(capabilities->indicatorName(indicator).data(),
+            indicatorSources(device, indicator), from, to, discreteInterval, approxModes, false);
+}
+
+std::optional<Relations::HistoryTask> Relations::historyTask(std::string name,
+        std::vector<std::shared_ptr<impl::Storage>> const &sources, time_point from, time_point to,
+        seconds discreteInterval, std::vector<ApproxMode> const &approxModes,
+        bool aggregateSources) {
+    // если параметр не связан ни с какими показателями, пропускаем
+    if (sources.empty()) {
+        return std::nullopt;
+    }
+    if (to <= from) {
+        throw std::runtime_error("'to' time must be greater than 'from' time");
+    }
+    if (discreteInterval != seconds(0) && approxModes.empty()) {
+        throw std::runtime_error("at least one approximation mode is required");
+    }
+
+    HistoryTask task{std::move(name), {}};
+    withQuery(sources, from, to, discreteInterval, approxModes, aggregateSources, [&](auto query) {
+        task.run = [query = std::move(query)]() {
+            auto columns = query.compute(query.from, query.to);
+            return HistoryColumns(std::make_move_iterator(columns.begin()),
+                    std::make_move_iterator(columns.end()));
+        };
+    });
+    return task;
+}
+
+std::optional<Relations::HistoryStream> Relations::historyStream(std::string name,
+        std::vector<std::shared_ptr<impl::Storage>> const &sources, time_point from, time_point to,
+        seconds discreteInterval, std::vector<ApproxMode> const &approxModes,
+        bool aggregateSources) {
+    if (sources.empty()) {
+        return std::nullopt;
+    }
+    if (to <= from) {
+        throw std::runtime_error("'to' time must be greater than 'from' time");
+    }
+    if (discreteInterval != seconds(0) && approxModes.empty()) {
+        throw std::runtime_error("at least one approximation mode is required");
+    }
+
+    HistoryStream stream{std::move(name), {}};
+    withQuery(sources, from, to, discreteInterval, approxModes, aggregateSources, [&](auto query) {
+        stream.next = std::move(query).stream();
+    });
+    return stream;
+}
 
 void Relations::awake(Device device, Parameter parameter) {
     map->setLastAwakeTime(device, parameter, hclock::now());
 }
+
+void Relations::setLateness(seconds value) {
+    waitLoaded();
+    lateness = value;
+    for (auto const &s: storage) {
+        configure(s.first);
+    }
+}
+
+void Relations::updateRetention() {
+    waitLoaded();
+    for (auto const &s: storage) {
+        configure(s.first);
+    }
+}
+
+void Relations::expire(time_point now) {
+    waitLoaded();
+    for (auto const &s: storage) {
+        std::visit([now](auto &series) { series.expire(now); }, *s.first.data);
+    }
+}
+
+void Relations::setColdStorage(impl::ColdStore *store, seconds age, std::size_t budget) {
+    coldStore = store;
+    coldAge = age;
+    coldBudget = budget;
+}
+
+std::size_t Relations::spill(time_point now) {
+    if (coldStore == nullptr) {
+        return 0;
+    }
+    waitLoaded();
+
+    struct Candidate {
+        time_point last;
+        std::size_t bytes;
+        std::function<void()> spill;
+    };
+
+    std::size_t resident = 0;
+    std::vector<Candidate> candidates;
+    for (auto const &s: storage) {
+        std::visit([&](auto &series) {
+            resident += series.heapBytes();
+            series.spillCandidates(now - coldAge, *coldStore, [&](time_point last, std::size_t bytes, auto spill) {
+                candidates.push_back({last, bytes, spill});
+            });
+        }, *s.first.data);
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+            [](auto const &a, auto const &b) { return a.last < b.last; });
+
+    std::size_t spilled = 0;
+    for (auto const &c: candidates) {
+        if (resident <= coldBudget) {
+            break;
+        }
+        c.spill();
+        resident -= c.bytes;
+        ++spilled;
+    }
+    return spilled;
+}
+
+Relations Relations::snapshot() const {
+    waitLoaded();
+    Relations copy(map, capabilities);
+    copy.lateness = lateness;
+
+    // один ряд может быть и в storage, и в receiveDependencies - копия должна сохранить это
+    std::unordered_map<impl::Storage const *, std::shared_ptr<impl::Storage>> copies;
+    auto clone = [&copies](std::shared_ptr<impl::Storage> const &s) {
+        auto &c = copies[s.get()];
+        if (!c) {
+            c = std::make_shared<impl::Storage>(*s);
+        }
+        return c;
+    };
+
+    for (auto const &s: storage) {
+        auto transmitData = s.first;
+        transmitData.data = clone(s.first.data);
+        copy.storage.emplace(std::move(transmitData), s.second);
+    }
+    for (auto const &r: receiveDependencies) {
+        auto &dependencies = copy.receiveDependencies[r.first];
+        for (auto const &s: r.second) {
+            dependencies.push_back(clone(s));
+        }
+    }
+    return copy;
+}
+
+void Relations::coldSegments(std::vector<std::shared_ptr<impl::Segment>> &segments) const {
+    waitLoaded();
+    for (auto const &s: storage) {
+        std::visit([&segments](auto const &series) { series.coldSegments(segments); }, *s.first.data);
+    }
+    std::sort(segments.begin(), segments.end());
+    segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+}
+
+void Relations::configure(impl::TransmitData const &transmitData) {
+    auto retention = capabilities->effectiveRetention(transmitData.indicator);
+    auto quantiles = capabilities->indicatorQuantiles(transmitData.indicator);
+    std::visit([&](auto &series) {
+        series.setLateness(lateness);
+        series.setRetention(retention);
+        series.setQuantiles(quantiles);
+    }, *transmitData.data);
+}
+
+std::uint64_t Relations::droppedLate() const {
+    waitLoaded();
+    std::uint64_t dropped = 0;
+    for (auto const &s: storage) {
+        std::visit([&dropped](auto const &series) { dropped += series.droppedLate(); },
+                *s.first.data);
+    }
+    return dropped;
+}
+
+void Relations::loadSeries(std::vector<std::shared_ptr<impl::Storage>> series,
+        impl::SeriesLoader::Read read, unsigned threads) {
+    // настройки рядов считаются здесь: рабочие потоки не должны обращаться к capabilities
+    std::unordered_map<impl::Storage const *, SeriesSettings> known;
+    for (auto const &s: storage) {
+        known[s.first.data.get()] = {capabilities->effectiveRetention(s.first.indicator),
+                capabilities->indicatorQuantiles(s.first.indicator)};
+    }
+    std::vector<SeriesSettings> settings;
+    for (auto const &s: series) {
+        settings.push_back(known[s.get()]);
+    }
+
+    loader = std::make_shared<impl::SeriesLoader>(std::move(series),
+            [read = std::move(read), settings = std::move(settings), lateness = lateness]
+                    (std::size_t i, impl::Storage &s) {
+                read(i, s);
+                std::visit([&](auto &series) {
+                    series.setLateness(lateness);
+                    series.setRetention(settings[i].retention);
+                    series.setQuantiles(settings[i].quantiles);
+                }, s);
+            }, threads);
+}
+
+void Relations::waitLoaded() const {
+    if (loader) {
+        loader->wait();
+    }
+}
+
+namespace impl {
+    SeriesLoader::SeriesLoader(std::vector<std::shared_ptr<Storage>> series, Read read,
+            unsigned threads) : series(std::move(series)), read(std::move(read)),
+            states(this->series.size(), State::Unloaded), errors(this->series.size()),
+            remaining(this->series.size()) {
+        for (std::size_t i = 0; i < this->series.size(); ++i) {
+            index[this->series[i].get()] = i;
+        }
+
+        for (unsigned t = 0; t < std::max(threads, 1u); ++t) {
+            workers.emplace_back([this]() {
+                std::unique_lock lock(mutex);
+                while (next < states.size()) {
+                    auto i = next++;
+                    if (states[i] == State::Unloaded) {
+                        load(i, lock);
+                    }
+                }
+            });
+        }
+    }
+
+    SeriesLoader::~SeriesLoader() {
+        {
+            std::lock_guard lock(mutex);
+            next = states.size();
+        }
+        for (auto &w: workers) {
+            w.join();
+        }
+    }
+
+    void SeriesLoader::load(std::size_t i, std::unique_lock<std::mutex> &lock) {
+        states[i] = State::Loading;
+        // пустой ряд нужного типа, читается без блокировки
+        Storage s = *series[i];
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            read(i, s);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        *series[i] = std::move(s);
+        errors[i] = error;
+        if (error) {
+            failed = true;
+        }
+        states[i] = State::Loaded;
+        --remaining;
+        loaded.notify_all();
+    }
+
+    void SeriesLoader::await(std::size_t i, std::unique_lock<std::mutex> &lock) {
+        if (states[i] == State::Unloaded) {
+            load(i, lock);
+        }
+        loaded.wait(lock, [&] { return states[i] == State::Loaded; });
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
+
+    void SeriesLoader::ensure(Storage const *s) {
+        if (remaining == 0 && !failed) {
+            return;
+        }
+        std::unique_lock lock(mutex);
+        auto it = index.find(s);
+        if (it != index.end()) {
+            await(it->second, lock);
+        }
+    }
+
+    void SeriesLoader::wait() {
+        if (remaining == 0 && !failed) {
+            return;
+        }
+        std::unique_lock lock(mutex);
+        for (std::size_t i = 0; i < states.size(); ++i) {
+            await(i, lock);
+        }
+    }
+}
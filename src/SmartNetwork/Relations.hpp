@@ -1,39 +1,93 @@
 #pragma once
 
 #include "DeviceMap.hpp"
+#include "Series.hpp"
+#include "Kernels.hpp"
+#include "Subscriptions.hpp"
+#include <cereal/types/utility.hpp>
 #include <variant>
 #include <algorithm>
-
-template<typename T>
-struct Timestamp {
-    T val;
-    time_point time;
-
-    template<class Archive>
-    void serialize(Archive &ar) {
-        ar(val, time);
-    }
-};
-
-enum class ApproxMode {
-    Min,
-    Max,
-    First,
-    Last,
-    Average,
-};
+#include <functional>
+#include <limits>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <optional>
 
 namespace impl {
     template<typename T>
-    using TypeStorage = std::vector<Timestamp<T>>;
+    using TypeStorage = Series<T>;
 
     using Storage = std::variant<TypeStorage<int>, TypeStorage<float>, TypeStorage<bool>>;
 
+    // ряды, которые ещё читаются с диска: рабочие потоки дочитывают их по очереди,
+    // а ряд, к которому обратились раньше, читается сразу в обращающемся потоке
+    class SeriesLoader {
+    public:
+        // read(i, s) читает i-й ряд в s; s уже имеет нужный тип
+        using Read = std::function<void(std::size_t, Storage &)>;
+
+        SeriesLoader(std::vector<std::shared_ptr<Storage>> series, Read read, unsigned threads);
+
+        SeriesLoader(SeriesLoader const &) = delete;
+
+        SeriesLoader &operator=(SeriesLoader const &) = delete;
+
+        ~SeriesLoader();
+
+        // дожидается, пока ряд s будет прочитан
+        void ensure(Storage const *s);
+
+        // дожидается всех рядов
+        void wait();
+
+    private:
+        enum class State {
+            Unloaded,
+            Loading,
+            Loaded,
+        };
+
+        void load(std::size_t i, std::unique_lock<std::mutex> &lock);
+
+        void await(std::size_t i, std::unique_lock<std::mutex> &lock);
+
+        std::vector<std::shared_ptr<Storage>> series;
+        Read read;
+        std::unordered_map<Storage const *, std::size_t> index;
+        std::vector<State> states;
+        std::vector<std::exception_ptr> errors;
+        std::size_t next = 0;
+        std::atomic<std::size_t> remaining;
+        std::atomic<bool> failed = false;
+        std::mutex mutex;
+        std::condition_variable loaded;
+        std::vector<std::thread> workers;
+    };
+
+    // получатели ряда, которым значение передаётся сразу, с уже найденными именами параметров;
+    // собирается при первой передаче после изменения связей, режимов или типов устройств
+    struct FanOut {
+        struct Target {
+            Device receiver;
+            Parameter parameter;
+            std::string name;
+        };
+
+        std::uint64_t generation = 0;
+        std::vector<Target> targets;
+    };
+
     struct TransmitData {
         Device transmitter;
         Indicator indicator;
         WorkMode workMode;
         mutable std::shared_ptr<impl::Storage> data;
+        // не сохраняется и не участвует в сравнении
+        mutable std::shared_ptr<FanOut const> fanOut;
 
         template<class Archive>
         void serialize(Archive &ar) {
@@ -64,76 +118,236 @@ namespace impl {
         }
     };
 
-    auto const timeCmp = [](auto &&lhs, auto &&rhs) { return lhs.time < rhs.time; };
+    // ряд снимка первых версий: значения в порядке прихода
+    using LegacyStorage = std::variant<std::vector<Timestamp<int>>, std::vector<Timestamp<float>>,
+            std::vector<Timestamp<bool>>>;
+
+    struct LegacyTransmitData {
+        Device transmitter;
+        Indicator indicator;
+        WorkMode workMode;
+        std::shared_ptr<LegacyStorage> data;
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(transmitter, indicator, workMode, data);
+        }
+    };
+
+    // связи одного передающего ряда в снимке, разбитом на разделы
+    struct SeriesLink {
+        Device transmitter;
+        Indicator indicator;
+        WorkMode workMode;
+        std::uint32_t series;
+        std::vector<ReceiveData> receivers;
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(transmitter, indicator, workMode, series, receivers);
+        }
+    };
+
+    struct SeriesDependency {
+        ReceiveData receiver;
+        std::vector<std::uint32_t> series;
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(receiver, series);
+        }
+    };
 
+    // все агрегаты на участке [begin, end) столбца; digest - строить и скетч квантилей
     template<typename T>
-    auto approximate(T begin, T end, ApproxMode approxMode) {
-        switch (approxMode) {
-            case ApproxMode::Min:
-                if constexpr(std::is_same_v<decltype(begin->val), bool>) {
-                    return std::find_if(begin, end, [](auto &&v) { return v.val == true; }) == end;
-                } else {
-                    return std::min_element(begin, end,
-                            [](auto &&lhs, auto &&rhs) { return lhs.val < rhs.val; })->val;
-                }
-            case ApproxMode::Max:
-                if constexpr(std::is_same_v<decltype(begin->val), bool>) {
-                    return std::find_if(begin, end, [](auto &&v) { return v.val == true; }) != end;
-                } else {
-                    return std::max_element(begin, end,
-                            [](auto &&lhs, auto &&rhs) { return lhs.val < rhs.val; })->val;
-                }
-            case ApproxMode::First:
-                return begin->val;
-            case ApproxMode::Last:
-                return (--end)->val;
-            case ApproxMode::Average: {
-                if constexpr(std::is_same_v<decltype(begin->val), bool>) {
-                    return std::find_if(begin, end, [](auto v) { return v.val == true; }) != end;
-                } else {
-                    float size = end - begin;
-                    decltype(begin->val) res{};
-                    for (; begin != end; ++begin) {
-                        res += begin->val;
-                    }
-                    return decltype(begin->val)(res / size);
+    Bucket<T> aggregate(Column<T> const &data, std::size_t begin, std::size_t end,
+            time_point start, bool digest) {
+        auto const values = data.val.data() + begin;
+        auto const size = end - begin;
+
+        Bucket<T> bucket{start};
+        if constexpr(std::is_same_v<T, bool>) {
+            bucket.min = kernels::all(values, size);
+            bucket.max = kernels::any(values, size);
+            bucket.sum = std::count(values, values + size, 1);
+        } else {
+            // сумма векторная, в другом порядке, чем в свёртках: средние вещественных
+            // значений могут расходиться с ними в последних разрядах
+            bucket.min = kernels::min(values, size);
+            bucket.max = kernels::max(values, size);
+            bucket.sum = kernels::sum(values, size);
+            if (digest) {
+                for (std::size_t i = 0; i < size; ++i) {
+                    bucket.digest.add(values[i]);
                 }
             }
-            default:
-                return decltype(begin->val){};
         }
+        bucket.first = data.val[begin];
+        bucket.firstTime = data.time[begin];
+        bucket.last = data.val[end - 1];
+        bucket.lastTime = data.time[end - 1];
+        bucket.count = size;
+        return bucket;
+    }
+
+    // разбивает отсортированные значения на интервалы, выровненные по эпохе,
+    // и вызывает f(begin, end, start) для каждого непустого интервала
+    template<typename V, typename F>
+    void groups(Column<V> const &data, seconds discreteInterval, F &&f) {
+        std::size_t begin = 0;
+        while (begin != data.size()) {
+            auto start = floorTime(data.time[begin], discreteInterval);
+            auto end = std::lower_bound(data.time.begin() + begin, data.time.end(),
+                    start + discreteInterval) - data.time.begin();
+            f(begin, end, start);
+            begin = end;
+        }
+    }
+
+    // обходит промежуток [from, to] интервалами discreteInterval: неполные крайние интервалы
+    // передаются в raw исходными значениями, а полные - в rolled из готовых свёрток.
+    // Если для квантилей (digests) у свёртки нет скетчей, из неё берутся только интервалы,
+    // исходные значения которых уже не хранятся, остальные считаются по исходным
+    template<typename R, typename FR, typename FB>
+    void scan(R const &data, time_point from, time_point to, seconds discreteInterval,
+            bool digests, FR &&raw, FB &&rolled) {
+        using T = typename R::value_type;
+        Column<T> samples;
+        auto rollup = data.rollup(discreteInterval, digests);
+
+        auto const tick = time_point::duration(1);
+        from = std::max(from, time_point::min() + 2 * discreteInterval);
+        to = std::min(to, time_point::max() - 2 * discreteInterval);
+        auto const lo = floorTime(from - tick, discreteInterval) + discreteInterval;
+        auto const hi = floorTime(to + tick, discreteInterval);
+
+        if (rollup == nullptr || lo >= hi) {
+            data.read(from, to, samples);
+            raw(samples);
+            return;
+        }
+
+        auto mid = hi;
+        if constexpr(!std::is_same_v<T, bool>) {
+            if (digests && !rollup->hasDigests()) {
+                auto oldest = std::clamp(data.oldest(), lo, hi);
+                mid = std::min(floorTime(oldest - tick, discreteInterval) + discreteInterval, hi);
+            }
+        }
+
+        data.read(from, lo - tick, samples);
+        raw(samples);
+
+        std::optional<Bucket<T>> bucket;
+        rollup->forEach(lo, mid, [&](Bucket<T> const &b) {
+            auto start = floorTime(b.start, discreteInterval);
+            if (bucket && bucket->start != start) {
+                rolled(*bucket);
+                bucket.reset();
+            }
+            if (!bucket) {
+                bucket = Bucket<T>{start};
+            }
+            bucket->merge(b, digests);
+        });
+        if (bucket) {
+            rolled(*bucket);
+        }
+
+        samples.clear();
+        data.read(mid, to, samples);
+        raw(samples);
     }
 
+    // агрегаты интервалов шириной discreteInterval на промежутке [from, to]: каждый
+    // интервал считается за один проход, из него потом берутся все нужные режимы.
+    // from == to - промежуток из одного момента: им кончается поток истории, если
+    // to попадает на границу окна
     template<typename T, typename R>
-    void history(T &result, R const &data, time_point from, time_point to,
-            seconds discreteInterval, ApproxMode approxMode) {
-        if (to <= from) {
-            throw std::runtime_error("'to' time must be greater than 'from' time");
-        }
-
-        // находим пограничные значения в заданном промежутке времени
-        auto begin = std::lower_bound(data.begin(), data.end(),
-                Timestamp<T>{T{}, from}, impl::timeCmp);
-        auto end = std::upper_bound(data.begin(), data.end(),
-                Timestamp<T>{T{}, to}, impl::timeCmp);
-
-        // разбиваем промежуток времени на диапазоны, вычисляя приблизительное значение
-        // на каждом из них, чтобы не передавать огромное количество данных просто так
-        if (discreteInterval != seconds(0)) {
-            auto lastBegin = begin;
-            for (seconds t(0); (t <= from - to) && begin != end; ++begin) {
-                if (begin->time - from > t + discreteInterval) {
-                    t += discreteInterval;
-                    result.push_back({impl::approximate(lastBegin, begin, approxMode), from + t});
-                    lastBegin = begin;
+    void buckets(std::vector<Bucket<T>> &result, R const &data, time_point from, time_point to,
+            seconds discreteInterval, bool digests) {
+        if (to < from) {
+            throw std::runtime_error("'to' time must not be less than 'from' time");
+        }
+
+        scan(data, from, to, discreteInterval, digests,
+                [&](auto const &samples) {
+                    groups(samples, discreteInterval, [&](auto begin, auto end, auto start) {
+                        result.push_back(impl::aggregate(samples, begin, end, start, digests));
+                    });
+                },
+                [&](auto const &bucket) {
+                    result.push_back(bucket);
+                });
+    }
+
+    // курсор по отсортированному вектору
+    template<typename X>
+    struct VectorCursor {
+        typename std::vector<X>::const_iterator it;
+        typename std::vector<X>::const_iterator end;
+
+        bool valid() const {
+            return it != end;
+        }
+
+        void next() {
+            ++it;
+        }
+    };
+
+    // k-путевое слияние отсортированных последовательностей через двоичную кучу;
+    // при равных ключах первым идёт курсор с меньшим номером. Куча сохраняется
+    // между вызовами take, поэтому слияние можно вести частями
+    template<typename C, typename K>
+    class Merge {
+    public:
+        Merge(std::vector<C> &cursors, K key) : cursors(&cursors), key(std::move(key)) {
+            for (std::size_t i = 0; i < cursors.size(); ++i) {
+                if (cursors[i].valid()) {
+                    heap.push_back(i);
                 }
             }
-        } else {
-            std::copy(begin, end, std::back_inserter(result));
+            std::make_heap(heap.begin(), heap.end(), greater());
         }
-    }
 
+        // передаёт в emit не больше limit курсоров по порядку ключей;
+        // false - все последовательности кончились
+        template<typename F>
+        bool take(F &&emit, std::size_t limit = std::numeric_limits<std::size_t>::max()) {
+            auto const cmp = greater();
+            for (; limit != 0 && !heap.empty(); --limit) {
+                std::pop_heap(heap.begin(), heap.end(), cmp);
+                auto &cursor = (*cursors)[heap.back()];
+                emit(cursor);
+                cursor.next();
+                if (cursor.valid()) {
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                } else {
+                    heap.pop_back();
+                }
+            }
+            return !heap.empty();
+        }
 
+    private:
+        auto greater() const {
+            return [this](std::size_t lhs, std::size_t rhs) {
+                auto l = key((*cursors)[lhs]);
+                auto r = key((*cursors)[rhs]);
+                return r < l || (!(l < r) && rhs < lhs);
+            };
+        }
+
+        std::vector<C> *cursors;
+        K key;
+        std::vector<std::size_t> heap;
+    };
+
+    template<typename C, typename K, typename F>
+    void merge(std::vector<C> &cursors, K &&key, F &&emit) {
+        Merge<C, std::decay_t<K>>(cursors, std::forward<K>(key)).take(emit);
+    }
 }
 
 template<>
@@ -163,63 +377,242 @@ public:
 
     template<class Archive>
     void save(Archive &ar) const {
+        waitLoaded();
         ar(storage, receiveDependencies);
     }
 
     template<class Archive>
     void load(Archive &ar) {
         ar(storage, receiveDependencies);
+        for (auto const &s: storage) {
+            configure(s.first);
+        }
+    }
+
+    // снимок из разделов: связи сохраняются вместе с метаданными, а ряды, перечисленные
+    // в series, - каждый в своём разделе
+    template<class Archive>
+    void saveLinks(Archive &ar, std::vector<std::shared_ptr<impl::Storage>> &series) const {
+        waitLoaded();
+        std::unordered_map<impl::Storage const *, std::uint32_t> ids;
+        auto id = [&](std::shared_ptr<impl::Storage> const &s) {
+            auto it = ids.emplace(s.get(), std::uint32_t(series.size())).first;
+            if (it->second == series.size()) {
+                series.push_back(s);
+            }
+            return it->second;
+        };
+
+        std::vector<impl::SeriesLink> links;
+        for (auto const &s: storage) {
+            links.push_back({s.first.transmitter, s.first.indicator, s.first.workMode,
+                    id(s.first.data), s.second});
+        }
+        std::vector<impl::SeriesDependency> dependencies;
+        for (auto const &r: receiveDependencies) {
+            dependencies.push_back({r.first, {}});
+            for (auto const &s: r.second) {
+                dependencies.back().series.push_back(id(s));
+            }
+        }
+        std::vector<std::uint8_t> types;
+        for (auto const &s: series) {
+            types.push_back(std::uint8_t(s->index()));
+        }
+        ar(types, links, dependencies);
+    }
+
+    // создаёт пустые ряды нужных типов; их данные потом читает loadSeries
+    template<class Archive>
+    void loadLinks(Archive &ar, std::vector<std::shared_ptr<impl::Storage>> &series) {
+        std::vector<std::uint8_t> types;
+        std::vector<impl::SeriesLink> links;
+        std::vector<impl::SeriesDependency> dependencies;
+        ar(types, links, dependencies);
+
+        for (auto type: types) {
+            switch (type) {
+                case 0:
+                    series.push_back(std::make_shared<impl::Storage>(impl::TypeStorage<int>{}));
+                    break;
+                case 1:
+                    series.push_back(std::make_shared<impl::Storage>(impl::TypeStorage<float>{}));
+                    break;
+                case 2:
+                    series.push_back(std::make_shared<impl::Storage>(impl::TypeStorage<bool>{}));
+                    break;
+                default:
+                    throw std::runtime_error("invalid series type in snapshot");
+            }
+        }
+
+        storage.clear();
+        receiveDependencies.clear();
+        for (auto &l: links) {
+            impl::TransmitData transmitData{l.transmitter, l.indicator, l.workMode, series.at(l.series)};
+            storage.emplace(std::move(transmitData), std::move(l.receivers));
+        }
+        for (auto &d: dependencies) {
+            auto &dependency = receiveDependencies[d.receiver];
+            for (auto i: d.series) {
+                dependency.push_back(series.at(i));
+            }
+        }
+    }
+
+    // снимок первых версий: словари связей с рядами-векторами. Словари cereal записывает
+    // так же, как векторы пар, поэтому они читаются без хешей; ряды перестраиваются в сжатые
+    template<class Archive>
+    void loadLegacy(Archive &ar) {
+        std::vector<std::pair<impl::LegacyTransmitData, std::vector<impl::ReceiveData>>> links;
+        std::vector<std::pair<impl::ReceiveData, std::vector<std::shared_ptr<impl::LegacyStorage>>>>
+                dependencies;
+        ar(links, dependencies);
+
+        // один ряд может быть и в связях, и в зависимостях - перестраивается он один раз
+        std::unordered_map<impl::LegacyStorage const *, std::shared_ptr<impl::Storage>> converted;
+        auto convert = [&converted](std::shared_ptr<impl::LegacyStorage> const &legacy) {
+            auto &s = converted[legacy.get()];
+            if (!s) {
+                s = std::visit([](auto &values) {
+                    using T = decltype(values.front().val);
+                    // значения приходили не по порядку, а опоздавшие сверх допуска
+                    // отбрасываются - поэтому они сначала сортируются
+                    std::stable_sort(values.begin(), values.end(),
+                            [](auto const &l, auto const &r) { return l.time < r.time; });
+                    impl::TypeStorage<T> series;
+                    for (auto const &v: values) {
+                        series.push_back(v);
+                    }
+                    return std::make_shared<impl::Storage>(std::move(series));
+                }, *legacy);
+            }
+            return s;
+        };
+
+        storage.clear();
+        receiveDependencies.clear();
+        for (auto &[l, receivers]: links) {
+            impl::TransmitData transmitData{l.transmitter, l.indicator, l.workMode, convert(l.data)};
+            auto it = storage.emplace(std::move(transmitData), std::move(receivers)).first;
+            configure(it->first);
+        }
+        for (auto &[receiver, series]: dependencies) {
+            auto &dependency = receiveDependencies[receiver];
+            for (auto const &s: series) {
+                dependency.push_back(convert(s));
+            }
+        }
+    }
+
+    // дочитывает ряды, созданные loadLinks, в threads рабочих потоках; пока ряд не прочитан,
+    // обращение к нему читает его сразу
+    void loadSeries(std::vector<std::shared_ptr<impl::Storage>> series,
+            impl::SeriesLoader::Read read, unsigned threads);
+
+    // дожидается чтения всех рядов
+    void waitLoaded() const;
+
+    // насколько позже самого нового значения ряда ещё принимаются опоздавшие
+    void setLateness(seconds value);
+
+    // сроки хранения в capabilities изменились: ряды получают новые
+    void updateRetention();
+
+    // собранные планы передачи устаревают; вызывается при изменении связей, режимов работы
+    // и типов устройств
+    void invalidateFanOut() {
+        ++fanOutGeneration;
+    }
+
+    // все переданные значения, в том числе не связанных показателей, проверяются по подпискам
+    void setSubscriptions(Subscriptions *value) {
+        subscriptions = value;
     }
 
+    std::uint64_t droppedLate() const;
+
+    // удаляет из всех рядов данные с истёкшим сроком хранения
+    void expire(time_point now);
+
+    // блоки старше age переносятся в store, пока сжатые данные в куче занимают больше budget байт
+    void setColdStorage(impl::ColdStore *store, seconds age, std::size_t budget);
+
+    // переносит самые старые блоки в холодное хранилище, возвращает число перенесённых
+    std::size_t spill(time_point now);
+
+    // копия для сохранения снимка: запечатанные блоки и куски свёрток рядов общие,
+    // копируются только незапечатанные значения
+    Relations snapshot() const;
+
+    // сегменты холодного хранилища, на которые ссылаются ряды
+    void coldSegments(std::vector<std::shared_ptr<impl::Segment>> &segments) const;
+
     void link(Device transmitter, Indicator indicator, Device receiver, Parameter parameter);
 
     void unlink(Device transmitter, Indicator indicator, Device receiver, Parameter parameter);
 
+    // история одного ряда
+    using HistoryData = std::variant<std::vector<Timestamp<int>>, std::vector<Timestamp<float>>,
+            std::vector<Timestamp<bool>>>;
+
+    // история ряда по каждому режиму приближения запроса, столбцы в порядке режимов;
+    // без интервала - единственный столбец исходных значений
+    using HistoryColumns = std::vector<HistoryData>;
+
+    // запрос истории, который можно выполнить в другом потоке: представления рядов
+    // снимаются сразу на вызывающем потоке, а run() читает только их
+    struct HistoryTask {
+        std::string name;
+        std::function<HistoryColumns()> run;
+    };
+
+    // та же история, выдаваемая частями в порядке времени: next(batch) возвращает false,
+    // когда ряд закончился; память не зависит от длины промежутка
+    struct HistoryStream {
+        std::string name;
+        std::function<bool(HistoryColumns &)> next;
+    };
+
+    // aggregateSources - считать каждый интервал сразу по всем передающим устройствам,
+    // а не отдельно по каждому; все режимы approxModes считаются за один проход
+    std::optional<HistoryTask> parameterHistoryTask(Device receiver, Parameter parameter,
+            time_point from, time_point to, seconds discreteInterval,
+            std::vector<ApproxMode> const &approxModes, bool aggregateSources = false);
+
+    std::optional<HistoryTask> indicatorHistoryTask(Device device, Indicator indicator,
+            time_point from, time_point to, seconds discreteInterval,
+            std::vector<ApproxMode> const &approxModes);
+
+    std::optional<HistoryStream> parameterHistoryStream(Device receiver, Parameter parameter,
+            time_point from, time_point to, seconds discreteInterval,
+            std::vector<ApproxMode> const &approxModes, bool aggregateSources = false);
+
+    std::optional<HistoryStream> indicatorHistoryStream(Device device, Indicator indicator,
+            time_point from, time_point to, seconds discreteInterval,
+            std::vector<ApproxMode> const &approxModes);
+
     template<typename F>
     void parameterHistory(F &&prepareHistory, Device receiver, Parameter parameter,
             time_point from, time_point to, seconds discreteInterval,
-            ApproxMode approxMode) {
-        auto wm = map->getWorkMode(receiver);
-        impl::ReceiveData receiveData{receiver, parameter, wm};
-        auto it = receiveDependencies.find(receiveData);
-        // если параметр не связан ни с какими показателями, пропускаем
-        if (it == receiveDependencies.end() || it->second.empty()) {
-            return;
+            ApproxMode approxMode, bool aggregateSources = false) {
+        auto task = parameterHistoryTask(receiver, parameter, from, to, discreteInterval,
+                {approxMode}, aggregateSources);
+        if (task) {
+            std::visit([&](auto const &result) { prepareHistory(task->name, result); },
+                    task->run().front());
         }
-
-        impl::Storage resultStorage;
-        std::visit([&resultStorage](auto const &s) {
-            resultStorage = std::decay_t<decltype(s)>{};
-        }, *it->second.front());
-
-        std::visit([&](auto &result) {
-            using T = std::decay_t<decltype(result)>;
-            // каждый параметр может зависеть от нескольких передающих устройств
-            for (auto &i: it->second) {
-                auto &data = std::get<T>(*i);
-                impl::history(result, data, from, to, discreteInterval, approxMode);
-            }
-            std::sort(result.begin(), result.end(), impl::timeCmp);
-            prepareHistory(capabilities->parameterName(parameter).data(), result);
-        }, resultStorage);
     }
 
     template<typename F>
     void indicatorHistory(F &&prepareHistory, Device device, Indicator indicator, time_point from,
             time_point to, seconds discreteInterval, ApproxMode approxMode) {
-        auto wm = map->getWorkMode(device);
-        impl::TransmitData transmitData{device, indicator, wm};
-        auto it = storage.find(transmitData);
-        if (it == storage.end()) {
-            return;
+        auto task = indicatorHistoryTask(device, indicator, from, to, discreteInterval,
+                {approxMode});
+        if (task) {
+            std::visit([&](auto const &result) { prepareHistory(task->name, result); },
+                    task->run().front());
         }
-
-        std::visit([&](auto const &data) {
-            using T = std::decay_t<decltype(data)>;
-            T result{};
-            impl::history(result, data, from, to, discreteInterval, approxMode);
-            prepareHistory(capabilities->indicatorName(indicator).data(), result);
-        }, *it->first.data);
     }
 
     template<typename F>
@@ -238,23 +631,117 @@ public:
 
         auto it = storage.find(transmitData);
 
+        bool accepted = true;
         if (it != storage.end()) {
-            Timestamp<T> timestamp{data, time};
-            std::get<impl::TypeStorage<T>>(*it->first.data).push_back(timestamp);
-
-            // идём через все устройства, получающие команды немедленно
-            for (auto r: it->second) {
-                if (map->getReceiveInstantly(r.receiver) &&
-                        map->getWorkMode(r.receiver) == r.workMode) {
-                    transmit(r.receiver, r.parameter, timestamp);
+            ensureLoaded(it->first.data.get());
+            accepted = deliver(transmit, *it, Timestamp<T>{data, time});
+        }
+        if (accepted) {
+            notify(transmitter, indicator, data, time);
+        }
+    }
+
+    // одно значение пакета
+    struct BatchSample {
+        Device transmitter;
+        Indicator indicator;
+        time_point time;
+        std::variant<int, float, bool> value;
+    };
+
+    // пакет значений разных устройств одним вызовом, в порядке пакета;
+    // ряд ищется заново только при смене устройства или показателя
+    template<typename F>
+    void transmit(F &&transmit, std::vector<BatchSample> const &samples) {
+        auto it = storage.end();
+        for (std::size_t i = 0; i < samples.size(); ++i) {
+            auto const &s = samples[i];
+            if (i == 0 || s.transmitter != samples[i - 1].transmitter ||
+                    s.indicator != samples[i - 1].indicator) {
+                it = storage.find(impl::TransmitData{s.transmitter, s.indicator,
+                        map->getWorkMode(s.transmitter)});
+                if (it != storage.end()) {
+                    ensureLoaded(it->first.data.get());
                 }
             }
+            bool accepted = true;
+            if (it != storage.end()) {
+                accepted = std::visit([&](auto val) {
+                    return deliver(transmit, *it, Timestamp<decltype(val)>{val, s.time});
+                }, s.value);
+            }
+            if (accepted) {
+                notify(s.transmitter, s.indicator, s.value, s.time);
+            }
         }
     }
 
 private:
+    void configure(impl::TransmitData const &transmitData);
+
+    // дописывает значение в ряд и передаёт его устройствам, получающим команды немедленно:
+    // transmit(plan, timestamp) вызывается один раз на значение. Значение, которое ряд
+    // отбросил как слишком позднее, никуда не передаётся, как и подписчикам; тогда false
+    template<typename F, typename T>
+    bool deliver(F &transmit,
+            std::pair<impl::TransmitData const, std::vector<impl::ReceiveData>> const &entry,
+            Timestamp<T> timestamp) {
+        if (!std::get<impl::TypeStorage<T>>(*entry.first.data).push_back(timestamp)) {
+            return false;
+        }
+
+        auto const &plan = fanOut(entry);
+        if (!plan.targets.empty()) {
+            transmit(plan, timestamp);
+        }
+        return true;
+    }
+
+    // значение для подписок: только принятое рядом или не хранимое вовсе (ряда нет)
+    void notify(Device device, Indicator indicator, Subscriptions::Value value,
+            time_point time) {
+        if (subscriptions != nullptr && !subscriptions->empty()) {
+            subscriptions->sample(device, indicator, value, time);
+        }
+    }
+
+    // план передачи ряда, собирается заново, если устарел; значения одного передатчика
+    // пишутся под одной блокировкой части, поэтому план строит только один поток
+    impl::FanOut const &fanOut(
+            std::pair<impl::TransmitData const, std::vector<impl::ReceiveData>> const &entry);
+
+    // ряды, из которых складывается история параметра или показателя
+    std::vector<std::shared_ptr<impl::Storage>> parameterSources(Device receiver,
+            Parameter parameter) const;
+
+    std::vector<std::shared_ptr<impl::Storage>> indicatorSources(Device device,
+            Indicator indicator) const;
+
+    std::optional<HistoryTask> historyTask(std::string name,
+            std::vector<std::shared_ptr<impl::Storage>> const &sources, time_point from,
+            time_point to, seconds discreteInterval, std::vector<ApproxMode> const &approxModes,
+            bool aggregateSources);
+
+    std::optional<HistoryStream> historyStream(std::string name,
+            std::vector<std::shared_ptr<impl::Storage>> const &sources, time_point from,
+            time_point to, seconds discreteInterval, std::vector<ApproxMode> const &approxModes,
+            bool aggregateSources);
+
+    void ensureLoaded(impl::Storage const *s) const {
+        if (loader) {
+            loader->ensure(s);
+        }
+    }
+
     DeviceMap *map;
     Capabilities *capabilities;
+    seconds lateness = std::chrono::hours(24);
+    impl::ColdStore *coldStore = nullptr;
+    seconds coldAge{};
+    std::size_t coldBudget = 0;
+    std::shared_ptr<impl::SeriesLoader> loader;
+    Subscriptions *subscriptions = nullptr;
+    std::uint64_t fanOutGeneration = 1;
     std::unordered_map<impl::TransmitData, std::vector<impl::ReceiveData>> storage;
     std::unordered_map<impl::ReceiveData, std::vector<std::shared_ptr<impl::Storage>>> receiveDependencies;
 };
\ No newline at end of file
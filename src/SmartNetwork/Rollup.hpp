@@ -0,0 +1,460 @@
+#pragma once
+
+#include "DeviceMap.hpp"
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+enum class ApproxMode {
+    Min,
+    Max,
+    First,
+    Last,
+    Average,
+    P50,
+    P95,
+    P99,
+};
+
+namespace impl {
+    // начало интервала шириной width, в который попадает time (отсчёт от эпохи)
+    inline time_point floorTime(time_point time, seconds width) {
+        auto w = std::chrono::duration_cast<time_point::duration>(width);
+        auto r = time.time_since_epoch() % w;
+        if (r < time_point::duration::zero()) {
+            r += w;
+        }
+        return time - r;
+    }
+
+    // сжатое распределение значений для квантилей (t-digest): соседние значения
+    // сливаются в центроиды, мелкие у краёв распределения и крупные в середине,
+    // поэтому p95/p99 точнее медианы. Скетчи сливаются без исходных значений
+    class Digest {
+    public:
+        // не больше примерно compression центроидов после сжатия
+        static constexpr double compression = 50;
+        static constexpr double pi = 3.14159265358979323846;
+
+        struct Centroid {
+            double mean;
+            std::uint32_t weight;
+
+            template<class Archive>
+            void serialize(Archive &ar) {
+                ar(mean, weight);
+            }
+        };
+
+        void add(double val) {
+            centroids.push_back({val, 1});
+            if (centroids.size() >= 2 * compression) {
+                compress();
+            }
+        }
+
+        void merge(Digest const &other) {
+            centroids.insert(centroids.end(), other.centroids.begin(), other.centroids.end());
+            if (centroids.size() >= 2 * compression) {
+                compress();
+            }
+        }
+
+        // сливает соседние центроиды, пока каждый занимает не больше единицы
+        // шкалы k(q) = compression / 2pi * asin(2q - 1)
+        void compress() {
+            if (centroids.size() < 2) {
+                return;
+            }
+            sort(centroids);
+
+            double total = 0;
+            for (auto const &c: centroids) {
+                total += c.weight;
+            }
+            auto scale = [total](double weight) {
+                return compression / (2 * pi) * std::asin(2 * std::min(weight / total, 1.0) - 1);
+            };
+
+            std::size_t out = 0;
+            double before = 0;
+            double left = scale(0);
+            for (std::size_t i = 1; i < centroids.size(); ++i) {
+                auto &cur = centroids[out];
+                auto const &c = centroids[i];
+                if (scale(before + cur.weight + c.weight) - left <= 1) {
+                    cur.weight += c.weight;
+                    cur.mean += (c.mean - cur.mean) * c.weight / cur.weight;
+                } else {
+                    before += cur.weight;
+                    left = scale(before);
+                    centroids[++out] = c;
+                }
+            }
+            centroids.resize(out + 1);
+        }
+
+        // окончательное сжатие, когда в скетч больше ничего не добавляется
+        void seal() {
+            compress();
+            centroids.shrink_to_fit();
+        }
+
+        void clear() {
+            std::vector<Centroid>().swap(centroids);
+        }
+
+        bool empty() const {
+            return centroids.empty();
+        }
+
+        // квантиль q из [0, 1]: линейная интерполяция между серединами центроидов,
+        // крайние доли достраиваются до min и max интервала
+        double quantile(double q, double min, double max) const {
+            if (centroids.empty()) {
+                return min + q * (max - min);
+            }
+            auto sorted = centroids;
+            Digest::sort(sorted);
+
+            double total = 0;
+            for (auto const &c: sorted) {
+                total += c.weight;
+            }
+            auto const target = q * total;
+
+            double before = 0;
+            double prevCenter = 0;
+            double prevMean = min;
+            for (auto const &c: sorted) {
+                auto center = before + c.weight / 2.0;
+                if (target < center) {
+                    return interpolate(prevMean, c.mean, (target - prevCenter) / (center - prevCenter));
+                }
+                before += c.weight;
+                prevCenter = center;
+                prevMean = c.mean;
+            }
+            if (total <= prevCenter) {
+                return prevMean;
+            }
+            return interpolate(prevMean, max, (target - prevCenter) / (total - prevCenter));
+        }
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(centroids);
+        }
+
+    private:
+        static void sort(std::vector<Centroid> &c) {
+            std::sort(c.begin(), c.end(), [](auto const &l, auto const &r) { return l.mean < r.mean; });
+        }
+
+        static double interpolate(double a, double b, double t) {
+            return a + (b - a) * std::clamp(t, 0.0, 1.0);
+        }
+
+        std::vector<Centroid> centroids;
+    };
+
+    // доля значений ниже квантиля режима approxMode, 0 - режим не квантиль
+    inline double quantileOf(ApproxMode approxMode) {
+        switch (approxMode) {
+            case ApproxMode::P50:
+                return 0.5;
+            case ApproxMode::P95:
+                return 0.95;
+            case ApproxMode::P99:
+                return 0.99;
+            default:
+                return 0;
+        }
+    }
+
+    // нужны ли для режимов approxModes скетчи квантилей
+    inline bool needsDigests(std::vector<ApproxMode> const &approxModes) {
+        return std::any_of(approxModes.begin(), approxModes.end(),
+                [](auto mode) { return quantileOf(mode) != 0; });
+    }
+
+    // агрегаты значений за один интервал времени
+    template<typename T>
+    struct Bucket {
+        time_point start;
+        T min{};
+        T max{};
+        T first{};
+        T last{};
+        time_point firstTime;
+        time_point lastTime;
+        double sum = 0;
+        std::uint32_t count = 0;
+        // распределение для квантилей, если его ведёт свёртка; у логических значений
+        // оно следует из sum и count, а без скетча квантиль интерполируется между min и max
+        Digest digest;
+
+        void add(T val, time_point time, bool digests = true) {
+            if (count == 0) {
+                min = max = first = last = val;
+                firstTime = lastTime = time;
+            } else {
+                min = std::min(min, val);
+                max = std::max(max, val);
+                // при равном времени опоздавшее значение считается более поздним
+                if (time < firstTime) {
+                    first = val;
+                    firstTime = time;
+                }
+                if (time >= lastTime) {
+                    last = val;
+                    lastTime = time;
+                }
+            }
+            sum += val;
+            ++count;
+            if constexpr(!std::is_same_v<T, bool>) {
+                if (digests) {
+                    digest.add(val);
+                }
+            }
+        }
+
+        // digests - сливать и скетчи квантилей, если они понадобятся
+        void merge(Bucket const &other, bool digests = true) {
+            if (other.count == 0) {
+                return;
+            }
+            if (count == 0) {
+                auto s = start;
+                *this = other;
+                start = s;
+                return;
+            }
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            if (other.firstTime < firstTime) {
+                first = other.first;
+                firstTime = other.firstTime;
+            }
+            if (other.lastTime >= lastTime) {
+                last = other.last;
+                lastTime = other.lastTime;
+            }
+            sum += other.sum;
+            count += other.count;
+            if (digests) {
+                digest.merge(other.digest);
+            }
+        }
+
+        T value(ApproxMode approxMode) const {
+            switch (approxMode) {
+                case ApproxMode::Min:
+                    // у логических значений, как и прежде, - "ни одного истинного"
+                    if constexpr(std::is_same_v<T, bool>) {
+                        return !max;
+                    } else {
+                        return min;
+                    }
+                case ApproxMode::Max:
+                    return max;
+                case ApproxMode::First:
+                    return first;
+                case ApproxMode::Last:
+                    return last;
+                case ApproxMode::Average:
+                    if constexpr(std::is_same_v<T, bool>) {
+                        return max;
+                    } else {
+                        return T(sum / count);
+                    }
+                case ApproxMode::P50:
+                case ApproxMode::P95:
+                case ApproxMode::P99:
+                    if constexpr(std::is_same_v<T, bool>) {
+                        // истинные значения идут после ложных
+                        return quantileOf(approxMode) > 1 - sum / count;
+                    } else {
+                        return T(digest.quantile(quantileOf(approxMode), min, max));
+                    }
+                default:
+                    return T{};
+            }
+        }
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(start, min, max, first, last, firstTime, lastTime, sum, count, digest);
+        }
+    };
+
+    // уровень свёртки: агрегаты по интервалам фиксированной ширины, по возрастанию времени.
+    // Скетчи квантилей ведутся только при digests: скетч занимает до полутора килобайт.
+    // Интервалы хранятся кусками, общими у копий: кусок копируется перед изменением,
+    // только если им владеет ещё кто-то, поэтому копия свёртки для снимка дешёвая
+    template<typename T>
+    class Rollup {
+    public:
+        explicit Rollup(seconds width = seconds(60)) : width(width) {}
+
+        void add(T val, time_point time) {
+            auto start = floorTime(time, width);
+            if (chunks.empty() || chunks.back()->back().start < start) {
+                // предыдущий интервал закрыт: дальше в него попадут разве что опоздавшие
+                if (digests && !chunks.empty()) {
+                    own(chunks.size() - 1).back().digest.seal();
+                }
+                if (chunks.empty() || chunks.back()->size() >= chunkSize) {
+                    chunks.push_back(std::make_shared<Chunk>());
+                    chunks.back()->reserve(chunkSize);
+                }
+                auto &chunk = own(chunks.size() - 1);
+                chunk.push_back(Bucket<T>{start});
+                chunk.back().add(val, time, digests);
+                return;
+            }
+
+            // интервал уже начат или опоздавшее значение: ищем или вставляем его интервал
+            auto c = std::partition_point(chunks.begin(), chunks.end(),
+                    [start](auto const &c) { return c->back().start < start; }) - chunks.begin();
+            auto &chunk = own(c);
+            auto it = std::partition_point(chunk.begin(), chunk.end(),
+                    [start](auto const &b) { return b.start < start; });
+            if (it->start != start) {
+                it = chunk.insert(it, Bucket<T>{start});
+            }
+            it->add(val, time, digests);
+            if (chunk.size() >= 2 * chunkSize) {
+                split(c);
+            }
+        }
+
+        // ведёт ли свёртка скетчи квантилей; при выключении накопленные скетчи выбрасываются
+        void setDigests(bool value) {
+            if (!value) {
+                for (std::size_t i = 0; i < chunks.size(); ++i) {
+                    if (std::any_of(chunks[i]->begin(), chunks[i]->end(),
+                            [](auto const &b) { return !b.digest.empty(); })) {
+                        for (auto &b: own(i)) {
+                            b.digest.clear();
+                        }
+                    }
+                }
+            }
+            digests = value;
+        }
+
+        bool hasDigests() const {
+            return digests;
+        }
+
+        // передаёт в f по возрастанию интервалы, начинающиеся в промежутке [from, to)
+        template<typename F>
+        void forEach(time_point from, time_point to, F &&f) const {
+            auto c = std::partition_point(chunks.begin(), chunks.end(),
+                    [from](auto const &c) { return c->back().start < from; });
+            for (; c != chunks.end() && (*c)->front().start < to; ++c) {
+                auto it = std::partition_point((*c)->begin(), (*c)->end(),
+                        [from](auto const &b) { return b.start < from; });
+                for (; it != (*c)->end() && it->start < to; ++it) {
+                    f(*it);
+                }
+            }
+        }
+
+        // свёртка из общих кусков, в которых есть интервалы промежутка [from, to)
+        Rollup slice(time_point from, time_point to) const {
+            Rollup result(width);
+            result.digests = digests;
+            auto c = std::partition_point(chunks.begin(), chunks.end(),
+                    [from](auto const &c) { return c->back().start < from; });
+            for (; c != chunks.end() && (*c)->front().start < to; ++c) {
+                result.chunks.push_back(*c);
+            }
+            return result;
+        }
+
+        // выбрасывает интервалы, целиком закончившиеся до before
+        void expire(time_point before) {
+            while (!chunks.empty() && chunks.front()->back().start + width <= before) {
+                chunks.pop_front();
+            }
+            if (!chunks.empty() && chunks.front()->front().start + width <= before) {
+                auto &chunk = own(0);
+                chunk.erase(chunk.begin(), std::partition_point(chunk.begin(), chunk.end(),
+                        [&](auto const &b) { return b.start + width <= before; }));
+            }
+        }
+
+        seconds interval() const {
+            return width;
+        }
+
+        // в снимке интервалы идут подряд, как раньше, без деления на куски
+        template<class Archive>
+        void save(Archive &ar) const {
+            std::size_t size = 0;
+            for (auto const &c: chunks) {
+                size += c->size();
+            }
+            ar(width, cereal::make_size_tag(static_cast<cereal::size_type>(size)));
+            for (auto const &c: chunks) {
+                for (auto const &b: *c) {
+                    ar(b);
+                }
+            }
+        }
+
+        template<class Archive>
+        void load(Archive &ar) {
+            cereal::size_type size;
+            ar(width, cereal::make_size_tag(size));
+            chunks.clear();
+            for (cereal::size_type i = 0; i < size; ++i) {
+                if (chunks.empty() || chunks.back()->size() >= chunkSize) {
+                    chunks.push_back(std::make_shared<Chunk>());
+                    chunks.back()->reserve(chunkSize);
+                }
+                chunks.back()->emplace_back();
+                ar(chunks.back()->back());
+            }
+        }
+
+    private:
+        using Chunk = std::vector<Bucket<T>>;
+
+        static constexpr std::size_t chunkSize = 64;
+
+        // кусок, который можно менять: общий с копией сначала копируется
+        Chunk &own(std::size_t i) {
+            auto &chunk = chunks[i];
+            if (chunk.use_count() != 1) {
+                chunk = std::make_shared<Chunk>(*chunk);
+            } else {
+                // копия могла только что отпустить кусок в другом потоке
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            return *chunk;
+        }
+
+        // делит разросшийся от опоздавших значений кусок пополам
+        void split(std::size_t i) {
+            auto &chunk = *chunks[i];
+            auto half = chunk.begin() + chunk.size() / 2;
+            auto tail = std::make_shared<Chunk>(std::make_move_iterator(half),
+                    std::make_move_iterator(chunk.end()));
+            chunk.erase(half, chunk.end());
+            chunks.insert(chunks.begin() + i + 1, std::move(tail));
+        }
+
+        seconds width;
+        bool digests = false;
+        // куски по возрастанию времени, пустых нет
+        std::deque<std::shared_ptr<Chunk>> chunks;
+    };
+}
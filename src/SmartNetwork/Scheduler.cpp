@@ -0,0 +1,125 @@
+#include "Scheduler.hpp"
+#include "Log.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+Scheduler::Scheduler(ThreadPool *executor, double jitter) :
+        executor(executor), jitter(std::clamp(jitter, 0.0, 1.0)) {
+}
+
+Scheduler::~Scheduler() {
+    stop();
+}
+
+void Scheduler::add(std::string name, clock::duration interval, std::function<void()> job) {
+    if (thread.joinable()) {
+        throw std::logic_error("maintenance scheduler is already running");
+    }
+    if (interval <= clock::duration::zero()) {
+        LOG(Info, "Maintenance job '" << name << "' is disabled");
+        return;
+    }
+    Task task;
+    task.stats.name = std::move(name);
+    task.stats.interval = interval;
+    task.job = std::move(job);
+    tasks.push_back(std::move(task));
+}
+
+void Scheduler::start() {
+    std::lock_guard lock(mutex);
+    auto now = clock::now();
+    for (auto &t: tasks) {
+        t.next = nextTime(t, now);
+    }
+    stopping = false;
+    thread = std::thread(&Scheduler::run, this);
+}
+
+void Scheduler::stop() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    std::unique_lock lock(mutex);
+    idle.wait(lock, [this] { return running == 0; });
+}
+
+std::vector<Scheduler::Stats> Scheduler::stats() const {
+    std::lock_guard lock(mutex);
+    std::vector<Stats> result;
+    result.reserve(tasks.size());
+    for (auto const &t: tasks) {
+        result.push_back(t.stats);
+    }
+    return result;
+}
+
+Scheduler::clock::time_point Scheduler::nextTime(Task const &task, clock::time_point from) {
+    std::uniform_real_distribution<double> shift(-jitter, jitter);
+    auto interval = std::chrono::duration<double>(task.stats.interval);
+    return from + std::chrono::duration_cast<clock::duration>(interval * (1 + shift(random)));
+}
+
+void Scheduler::run() {
+    std::unique_lock lock(mutex);
+    while (!stopping) {
+        auto next = clock::time_point::max();
+        for (auto const &t: tasks) {
+            next = std::min(next, t.next);
+        }
+        if (next == clock::time_point::max()) {
+            wake.wait(lock, [this] { return stopping; });
+            return;
+        }
+        if (wake.wait_until(lock, next, [this] { return stopping; })) {
+            return;
+        }
+
+        auto now = clock::now();
+        for (std::size_t i = 0; i < tasks.size(); ++i) {
+            auto &t = tasks[i];
+            if (t.next > now) {
+                continue;
+            }
+            // следующий срок считается от текущего, а не от пропущенных
+            t.next = nextTime(t, now);
+            if (t.stats.running) {
+                ++t.stats.skipped;
+                LOG(Warning, "Maintenance job '" << t.stats.name
+                        << "' is still running, skipping this run");
+                continue;
+            }
+            t.stats.running = true;
+            ++running;
+            executor->submit([this, i]() { execute(i); });
+        }
+    }
+}
+
+void Scheduler::execute(std::size_t index) {
+    auto &task = tasks[index];
+    auto start = clock::now();
+    std::string error;
+    try {
+        task.job();
+    }
+    catch (std::exception const &e) {
+        error = e.what();
+        LOG(Error, "Maintenance job '" << task.stats.name << "' failed: " << error);
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start);
+    LOG(Debug, "Maintenance job '" << task.stats.name << "' took " << duration.count() << " ms");
+
+    std::lock_guard lock(mutex);
+    task.stats.running = false;
+    ++task.stats.runs;
+    task.stats.duration = duration;
+    task.stats.error = std::move(error);
+    --running;
+    idle.notify_all();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ThreadPool.hpp"
+
+// периодическое обслуживание (снимки, очистка, перенос в холодное хранилище): у каждой
+// задачи свой интервал, сроки отсчитывает отдельный поток, а сами задачи выполняются
+// в пуле и не задерживают поток событий. Если задача ещё выполняется к следующему сроку,
+// этот запуск пропускается
+class Scheduler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Stats {
+        std::string name;
+        clock::duration interval{};
+        std::uint64_t runs = 0;
+        std::uint64_t skipped = 0;  // запуски, пропущенные из-за незаконченного предыдущего
+        bool running = false;
+        std::chrono::milliseconds duration{};  // последнего выполнения
+        std::string error;  // последнего выполнения, пусто - без ошибки
+    };
+
+    // jitter - доля интервала, на которую случайно сдвигается каждый срок,
+    // чтобы задачи с одинаковыми интервалами не запускались одновременно
+    explicit Scheduler(ThreadPool *executor, double jitter = 0.1);
+
+    Scheduler(Scheduler const &) = delete;
+
+    Scheduler &operator=(Scheduler const &) = delete;
+
+    ~Scheduler();
+
+    // вызывается до start; нулевой интервал выключает задачу
+    void add(std::string name, clock::duration interval, std::function<void()> job);
+
+    // первый запуск каждой задачи - через её интервал
+    void start();
+
+    // останавливает отсчёт сроков и дожидается выполняющихся задач
+    void stop();
+
+    std::vector<Stats> stats() const;
+
+private:
+    struct Task {
+        Stats stats;
+        std::function<void()> job;
+        clock::time_point next;
+    };
+
+    clock::time_point nextTime(Task const &task, clock::time_point from);
+
+    void run();
+
+    void execute(std::size_t index);
+
+    ThreadPool *executor;
+    double jitter;
+    std::mt19937 random{std::random_device()()};
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    // после start не меняется, кроме stats и next под mutex
+    std::vector<Task> tasks;
+    std::size_t running = 0;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,171 @@
+#include "Series.hpp"
+#include <cstring>
+
+namespace impl {
+    namespace {
+        std::uint64_t mask(unsigned bits) {
+            return bits == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << bits) - 1;
+        }
+
+        unsigned leadingZeros(std::uint32_t v) {
+            unsigned n = 0;
+            for (std::uint32_t bit = 0x80000000u; bit != 0 && !(v & bit); bit >>= 1) {
+                ++n;
+            }
+            return n;
+        }
+
+        unsigned trailingZeros(std::uint32_t v) {
+            unsigned n = 0;
+            for (std::uint32_t bit = 1; bit != 0 && !(v & bit); bit <<= 1) {
+                ++n;
+            }
+            return n;
+        }
+    }
+
+    void BitWriter::write(std::uint64_t value, unsigned bits) {
+        value &= mask(bits);
+        while (bits > 0) {
+            if (used == 64) {
+                words.push_back(0);
+                used = 0;
+            }
+            unsigned free = 64 - used;
+            unsigned take = std::min(bits, free);
+            std::uint64_t chunk = (value >> (bits - take)) & mask(take);
+            words.back() |= chunk << (free - take);
+            used += take;
+            bits -= take;
+        }
+    }
+
+    // zigzag-представление с префиксным кодом длины:
+    // 0 -> '0', далее '10' + 7 бит, '110' + 9, '1110' + 12, '11110' + 32, '11111' + 64
+    void BitWriter::writeSigned(std::int64_t value) {
+        auto zz = (static_cast<std::uint64_t>(value) << 1) ^
+                static_cast<std::uint64_t>(value >> 63);
+        if (zz == 0) {
+            write(0b0, 1);
+        } else if (zz < (1u << 7)) {
+            write(0b10, 2);
+            write(zz, 7);
+        } else if (zz < (1u << 9)) {
+            write(0b110, 3);
+            write(zz, 9);
+        } else if (zz < (1u << 12)) {
+            write(0b1110, 4);
+            write(zz, 12);
+        } else if (zz < (std::uint64_t(1) << 32)) {
+            write(0b11110, 5);
+            write(zz, 32);
+        } else {
+            write(0b11111, 5);
+            write(zz, 64);
+        }
+    }
+
+    std::uint64_t BitReader::read(unsigned bits) {
+        std::uint64_t value = 0;
+        while (bits > 0) {
+            unsigned used = pos % 64;
+            unsigned take = std::min(bits, 64 - used);
+            std::uint64_t chunk = (words[pos / 64] >> (64 - used - take)) & mask(take);
+            value = (take == 64 ? 0 : value << take) | chunk;
+            pos += take;
+            bits -= take;
+        }
+        return value;
+    }
+
+    std::int64_t BitReader::readSigned() {
+        unsigned prefix = 0;
+        while (prefix < 5 && read(1)) {
+            ++prefix;
+        }
+
+        static constexpr unsigned widths[] = {0, 7, 9, 12, 32, 64};
+        if (prefix == 0) {
+            return 0;
+        }
+        std::uint64_t zz = read(widths[prefix]);
+        return static_cast<std::int64_t>(zz >> 1) ^ -static_cast<std::int64_t>(zz & 1);
+    }
+
+    std::int64_t timeUnit(std::int64_t const *ticks, std::size_t size) {
+        using period = time_point::period;
+        std::int64_t const perSecond = period::den / period::num;
+        for (std::int64_t unit: {perSecond, perSecond / 1000, perSecond / 1000000}) {
+            if (unit <= 1) {
+                break;
+            }
+            if (std::all_of(ticks, ticks + size, [unit](auto t) { return t % unit == 0; })) {
+                return unit;
+            }
+        }
+        return 1;
+    }
+
+    void ValueEncoder<float>::write(BitWriter &w, float val) {
+        std::uint32_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+
+        if (first) {
+            w.write(bits, 32);
+            first = false;
+            prev = bits;
+            return;
+        }
+
+        std::uint32_t x = bits ^ prev;
+        prev = bits;
+        if (x == 0) {
+            w.write(0b0, 1);
+            return;
+        }
+
+        unsigned lead = std::min(leadingZeros(x), 31u);
+        unsigned trail = trailingZeros(x);
+        if (leading + trailing != 0 && lead >= leading && trail >= trailing) {
+            // значащие биты укладываются в предыдущее окно
+            w.write(0b10, 2);
+            w.write(x >> trailing, 32 - leading - trailing);
+        } else {
+            leading = lead;
+            trailing = trail;
+            unsigned meaningful = 32 - lead - trail;
+            w.write(0b11, 2);
+            w.write(lead, 5);
+            w.write(meaningful - 1, 5);
+            w.write(x >> trail, meaningful);
+        }
+    }
+
+    float ValueDecoder<float>::read(BitReader &r) {
+        if (first) {
+            prev = r.read(32);
+            first = false;
+        } else if (r.read(1)) {
+            if (r.read(1)) {
+                leading = r.read(5);
+                unsigned meaningful = r.read(5) + 1;
+                trailing = 32 - leading - meaningful;
+            }
+            prev ^= static_cast<std::uint32_t>(r.read(32 - leading - trailing)) << trailing;
+        }
+
+        float val;
+        std::memcpy(&val, &prev, sizeof(val));
+        return val;
+    }
+
+    void ValueEncoder<int>::write(BitWriter &w, int val) {
+        w.writeSigned(std::int64_t(val) - prev);
+        prev = val;
+    }
+
+    int ValueDecoder<int>::read(BitReader &r) {
+        prev += r.readSigned();
+        return static_cast<int>(prev);
+    }
+}
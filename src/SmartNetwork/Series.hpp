@@ -0,0 +1,690 @@
+#pragma once
+
+#include "DeviceMap.hpp"
+#include "Rollup.hpp"
+#include "ColdStore.hpp"
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+template<typename T>
+struct Timestamp {
+    T val;
+    time_point time;
+
+    template<class Archive>
+    void serialize(Archive &ar) {
+        ar(val, time);
+    }
+};
+
+namespace impl {
+    // побитовая запись в массив 64-битных слов, старшие биты идут первыми
+    class BitWriter {
+    public:
+        explicit BitWriter(std::vector<std::uint64_t> &words) : words(words) {}
+
+        void write(std::uint64_t value, unsigned bits);
+
+        void writeSigned(std::int64_t value);
+
+    private:
+        std::vector<std::uint64_t> &words;
+        unsigned used = 64;
+    };
+
+    class BitReader {
+    public:
+        explicit BitReader(std::uint64_t const *words) : words(words) {}
+
+        std::uint64_t read(unsigned bits);
+
+        std::int64_t readSigned();
+
+    private:
+        std::uint64_t const *words;
+        std::size_t pos = 0;
+    };
+
+    // наибольшая единица времени (в тиках часов), на которую делятся все метки блока
+    std::int64_t timeUnit(std::int64_t const *ticks, std::size_t size);
+
+    // кодирование значений: float - XOR с предыдущим (Gorilla), int - дельта, bool - бит
+    template<typename T>
+    class ValueEncoder;
+
+    template<typename T>
+    class ValueDecoder;
+
+    template<>
+    class ValueEncoder<float> {
+    public:
+        void write(BitWriter &w, float val);
+
+    private:
+        std::uint32_t prev = 0;
+        unsigned leading = 0;
+        unsigned trailing = 0;
+        bool first = true;
+    };
+
+    template<>
+    class ValueDecoder<float> {
+    public:
+        float read(BitReader &r);
+
+    private:
+        std::uint32_t prev = 0;
+        unsigned leading = 0;
+        unsigned trailing = 0;
+        bool first = true;
+    };
+
+    template<>
+    class ValueEncoder<int> {
+    public:
+        void write(BitWriter &w, int val);
+
+    private:
+        std::int64_t prev = 0;
+    };
+
+    template<>
+    class ValueDecoder<int> {
+    public:
+        int read(BitReader &r);
+
+    private:
+        std::int64_t prev = 0;
+    };
+
+    template<>
+    class ValueEncoder<bool> {
+    public:
+        void write(BitWriter &w, bool val) {
+            w.write(val, 1);
+        }
+    };
+
+    template<>
+    class ValueDecoder<bool> {
+    public:
+        bool read(BitReader &r) {
+            return r.read(1);
+        }
+    };
+
+    // значения bool хранятся байтами, чтобы столбец оставался непрерывным массивом
+    template<typename T>
+    using ColumnValue = std::conditional_t<std::is_same_v<T, bool>, std::uint8_t, T>;
+
+    // значения ряда в виде структуры массивов: отдельно метки времени и отдельно значения,
+    // чтобы агрегаты по значениям считались векторными инструкциями
+    template<typename T>
+    struct Column {
+        std::vector<time_point> time;
+        std::vector<ColumnValue<T>> val;
+
+        void push_back(T v, time_point t) {
+            time.push_back(t);
+            val.push_back(v);
+        }
+
+        // дописывает значения с индексами [begin, end) другого столбца
+        void append(Column const &other, std::size_t begin, std::size_t end) {
+            time.insert(time.end(), other.time.begin() + begin, other.time.begin() + end);
+            val.insert(val.end(), other.val.begin() + begin, other.val.begin() + end);
+        }
+
+        void reserve(std::size_t size) {
+            time.reserve(size);
+            val.reserve(size);
+        }
+
+        void clear() {
+            time.clear();
+            val.clear();
+        }
+
+        std::size_t size() const {
+            return time.size();
+        }
+
+        bool empty() const {
+            return time.empty();
+        }
+
+        // индексы значений, попадающих в промежуток [from, to]
+        std::pair<std::size_t, std::size_t> range(time_point from, time_point to) const {
+            auto begin = std::lower_bound(time.begin(), time.end(), from);
+            auto end = std::upper_bound(begin, time.end(), to);
+            return {begin - time.begin(), end - time.begin()};
+        }
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(time, val);
+        }
+    };
+
+    // неизменяемый сжатый блок: метки времени хранятся как дельты дельт,
+    // значения - кодировщиком своего типа. Сжатые данные лежат либо в куче,
+    // либо в сегменте холодного хранилища
+    template<typename T>
+    struct Block {
+        time_point first;
+        time_point last;
+        std::uint32_t count = 0;
+        std::int64_t unit = 1;
+        std::vector<std::uint64_t> bits;
+        std::shared_ptr<Segment> segment;
+        std::uint64_t offset = 0;
+        std::uint64_t words = 0;
+
+        std::uint64_t const *data() const {
+            return segment ? segment->data() + offset : bits.data();
+        }
+
+        bool cold() const {
+            return segment != nullptr;
+        }
+
+        // сколько памяти кучи занимают сжатые данные
+        std::size_t heapBytes() const {
+            return bits.size() * sizeof(std::uint64_t);
+        }
+
+        // копия блока, данные которой перенесены в холодное хранилище
+        Block spill(ColdStore &store) const {
+            Block block;
+            block.first = first;
+            block.last = last;
+            block.count = count;
+            block.unit = unit;
+            block.words = bits.size();
+            auto location = store.write(bits.data(), bits.size());
+            block.segment = std::move(location.segment);
+            block.offset = location.offset;
+            return block;
+        }
+
+        static Block encode(Column<T> const &data, std::size_t begin, std::size_t end) {
+            Block block;
+            block.first = data.time[begin];
+            block.last = data.time[end - 1];
+            block.count = end - begin;
+
+            std::vector<std::int64_t> ticks(end - begin);
+            for (std::size_t i = begin; i < end; ++i) {
+                ticks[i - begin] = data.time[i].time_since_epoch().count();
+            }
+            block.unit = timeUnit(ticks.data(), ticks.size());
+
+            BitWriter w(block.bits);
+            ValueEncoder<T> values;
+            std::int64_t prevDelta = 0;
+            for (std::size_t i = 0; i < ticks.size(); ++i) {
+                if (i != 0) {
+                    std::int64_t delta = (ticks[i] - ticks[i - 1]) / block.unit;
+                    w.writeSigned(delta - prevDelta);
+                    prevDelta = delta;
+                }
+                values.write(w, data.val[begin + i]);
+            }
+            block.bits.shrink_to_fit();
+            return block;
+        }
+
+        void decode(Column<T> &out) const {
+            BitReader r(data());
+            ValueDecoder<T> values;
+            std::int64_t tick = first.time_since_epoch().count();
+            std::int64_t delta = 0;
+            out.reserve(out.size() + count);
+            for (std::uint32_t i = 0; i < count; ++i) {
+                if (i != 0) {
+                    delta += r.readSigned();
+                    tick += delta * unit;
+                }
+                out.push_back(values.read(r), time_point(time_point::duration(tick)));
+            }
+        }
+
+        // холодный блок сохраняется ссылкой на свой сегмент
+        template<class Archive>
+        void save(Archive &ar) const {
+            ar(first, last, count, unit, cold());
+            if (cold()) {
+                ar(ColdStore::current()->name(*segment), offset, words);
+            } else {
+                ar(bits);
+            }
+        }
+
+        template<class Archive>
+        void load(Archive &ar) {
+            bool isCold;
+            ar(first, last, count, unit, isCold);
+            if (isCold) {
+                std::string name;
+                ar(name, offset, words);
+                if (ColdStore::current() == nullptr) {
+                    throw std::runtime_error("snapshot refers to cold storage, but it is disabled");
+                }
+                segment = ColdStore::current()->open(name);
+            } else {
+                ar(bits);
+            }
+        }
+    };
+
+    // временной ряд: запечатанные сжатые блоки фиксированного размера
+    // и небольшой изменяемый головной блок, куда попадают новые значения.
+    // Значения, пришедшие не по порядку, копятся в буфере и вливаются в
+    // отсортированные данные пачками; слишком старые отбрасываются.
+    // Параллельно поддерживаются свёртки по минутам, часам и дням.
+    // Устаревшие данные удаляются целыми блоками и интервалами с начала ряда
+    template<typename T>
+    class Series {
+    public:
+        using value_type = T;
+
+        static constexpr std::size_t blockSize = 512;
+
+        static constexpr std::size_t mergeBatch = 64;
+
+        bool push_back(Timestamp<T> const &timestamp) {
+            // newest только растёт, даже если срок хранения удалил все данные: значения
+            // старше уже удалённых не возвращаются в ряд
+            if (timestamp.time >= newest) {
+                newest = timestamp.time;
+                append(timestamp.val, timestamp.time);
+            } else if (newest - timestamp.time > lateness) {
+                ++dropped;
+                return false;
+            } else {
+                pending.push_back(timestamp);
+                if (pending.size() >= mergeBatch) {
+                    merge();
+                }
+            }
+
+            for (auto &r: rollups) {
+                r.add(timestamp.val, timestamp.time);
+            }
+            expire(newest);
+            return true;
+        }
+
+        // удаляет данные, вышедшие за пределы срока хранения к моменту now
+        void expire(time_point now) {
+            auto const raw = retention.raw.value_or(seconds(0));
+            if (raw != seconds(0)) {
+                while (!blocks.empty() && blocks.front()->last < now - raw) {
+                    blocks.pop_front();
+                }
+            }
+
+            seconds const keep[] = {retention.minutes.value_or(seconds(0)),
+                    retention.hours.value_or(seconds(0)), retention.days.value_or(seconds(0))};
+            for (std::size_t i = 0; i < rollups.size(); ++i) {
+                if (keep[i] != seconds(0)) {
+                    rollups[i].expire(now - keep[i]);
+                }
+            }
+        }
+
+        // самая грубая свёртка, из интервалов которой складывается interval;
+        // digests - нужны квантили, и свёртки со скетчами предпочтительнее
+        Rollup<T> const *rollup(seconds interval, bool digests = false) const {
+            Rollup<T> const *result = nullptr;
+            for (auto it = rollups.rbegin(); it != rollups.rend(); ++it) {
+                if (interval % it->interval() != seconds(0)) {
+                    continue;
+                }
+                if (!digests || std::is_same_v<T, bool> || it->hasDigests()) {
+                    return &*it;
+                }
+                if (result == nullptr) {
+                    result = &*it;
+                }
+            }
+            return result;
+        }
+
+        // время самого старого из хранящихся исходных значений
+        time_point oldest() const {
+            auto result = time_point::max();
+            if (!blocks.empty()) {
+                result = blocks.front()->first;
+            } else if (!head.empty()) {
+                result = head.time.front();
+            }
+            for (auto const &p: pending) {
+                result = std::min(result, p.time);
+            }
+            return result;
+        }
+
+        // согласованная копия для чтения промежутка [from, to] с шагом interval в другом потоке:
+        // запечатанные блоки и куски свёртки, нужной для interval, общие
+        Series view(time_point from, time_point to, seconds interval, bool digests) const {
+            Series result;
+            result.newest = newest;
+            result.lateness = lateness;
+            result.retention = retention;
+            result.dropped = dropped;
+
+            auto it = std::partition_point(blocks.begin(), blocks.end(),
+                    [from](auto const &b) { return b->last < from; });
+            for (; it != blocks.end() && (*it)->first <= to; ++it) {
+                result.blocks.push_back(*it);
+            }
+            result.head = head;
+            result.pending = pending;
+
+            for (std::size_t i = 0; i < rollups.size(); ++i) {
+                result.rollups[i] = Rollup<T>(rollups[i].interval());
+                result.rollups[i].setDigests(rollups[i].hasDigests());
+            }
+            if (interval != seconds(0)) {
+                if (auto r = rollup(interval, digests)) {
+                    from = std::max(from, time_point::min() + 2 * interval);
+                    result.rollups[r - rollups.data()] = r->slice(floorTime(from, interval), to);
+                }
+            }
+            return result;
+        }
+
+        // последовательный обход значений промежутка [from, to] по одному блоку за раз,
+        // не распаковывая весь промежуток в память
+        class Cursor {
+        public:
+            Cursor(Series const &series, time_point from, time_point to) :
+                    series(&series), from(from), to(to) {
+                block = std::partition_point(series.blocks.begin(), series.blocks.end(),
+                        [from](auto const &b) { return b->last < from; }) - series.blocks.begin();
+
+                for (auto const &p: series.pending) {
+                    if (p.time >= from && p.time <= to) {
+                        late.push_back(p);
+                    }
+                }
+                std::stable_sort(late.begin(), late.end(),
+                        [](auto &&lhs, auto &&rhs) { return lhs.time < rhs.time; });
+
+                load();
+            }
+
+            bool valid() const {
+                return index < chunk.size();
+            }
+
+            time_point time() const {
+                return chunk.time[index];
+            }
+
+            T value() const {
+                return chunk.val[index];
+            }
+
+            void next() {
+                if (++index == chunk.size()) {
+                    load();
+                }
+            }
+
+            // текущий блок значений целиком; nextChunk переходит к следующему
+            Column<T> const &current() const {
+                return chunk;
+            }
+
+            bool nextChunk() {
+                load();
+                return valid();
+            }
+
+        private:
+            enum class Stage {
+                Blocks,
+                Head,
+                Late,
+                Done,
+            };
+
+            void load() {
+                chunk.clear();
+                index = 0;
+                while (chunk.empty() && stage != Stage::Done) {
+                    if (stage == Stage::Blocks) {
+                        auto const &blocks = series->blocks;
+                        if (block < blocks.size() && blocks[block]->first <= to) {
+                            decoded.clear();
+                            blocks[block++]->decode(decoded);
+                            take(decoded);
+                        } else {
+                            stage = Stage::Head;
+                        }
+                    } else if (stage == Stage::Head) {
+                        take(series->head);
+                        stage = Stage::Late;
+                    } else {
+                        for (; lateIndex < late.size(); ++lateIndex) {
+                            chunk.push_back(late[lateIndex].val, late[lateIndex].time);
+                        }
+                        stage = Stage::Done;
+                    }
+                }
+            }
+
+            // берёт из column значения промежутка, подмешивая опоздавшие до его конца
+            void take(Column<T> const &column) {
+                auto [begin, end] = column.range(from, to);
+                if (begin == end) {
+                    return;
+                }
+                auto const last = column.time[end - 1];
+                for (; begin < end; ++begin) {
+                    for (; lateIndex < late.size() && late[lateIndex].time < column.time[begin];
+                            ++lateIndex) {
+                        chunk.push_back(late[lateIndex].val, late[lateIndex].time);
+                    }
+                    chunk.time.push_back(column.time[begin]);
+                    chunk.val.push_back(column.val[begin]);
+                }
+                for (; lateIndex < late.size() && late[lateIndex].time <= last; ++lateIndex) {
+                    chunk.push_back(late[lateIndex].val, late[lateIndex].time);
+                }
+            }
+
+            Series const *series;
+            time_point from;
+            time_point to;
+            std::size_t block = 0;
+            Stage stage = Stage::Blocks;
+            std::vector<Timestamp<T>> late;
+            std::size_t lateIndex = 0;
+            Column<T> decoded;
+            Column<T> chunk;
+            std::size_t index = 0;
+        };
+
+        // добавляет в out все значения из промежутка [from, to] в порядке времени
+        void read(time_point from, time_point to, Column<T> &out) const {
+            Cursor cursor(*this, from, to);
+            while (cursor.valid()) {
+                out.append(cursor.current(), 0, cursor.current().size());
+                cursor.nextChunk();
+            }
+        }
+
+        void read(time_point from, time_point to, std::vector<Timestamp<T>> &out) const {
+            Column<T> column;
+            read(from, to, column);
+            out.reserve(out.size() + column.size());
+            for (std::size_t i = 0; i < column.size(); ++i) {
+                out.push_back({T(column.val[i]), column.time[i]});
+            }
+        }
+
+        // вливает буфер опоздавших значений, перепаковывая затронутые блоки
+        void merge() {
+            if (pending.empty()) {
+                return;
+            }
+
+            std::stable_sort(pending.begin(), pending.end(),
+                    [](auto &&lhs, auto &&rhs) { return lhs.time < rhs.time; });
+
+            auto earliest = pending.front().time;
+            auto it = std::partition_point(blocks.begin(), blocks.end(),
+                    [earliest](auto const &b) { return b->last <= earliest; });
+
+            Column<T> tail;
+            tail.reserve((blocks.end() - it) * blockSize + head.size());
+            for (auto b = it; b != blocks.end(); ++b) {
+                (*b)->decode(tail);
+            }
+            tail.append(head, 0, head.size());
+
+            Column<T> merged;
+            mergeInto(merged, tail, pending);
+
+            blocks.erase(it, blocks.end());
+            head.clear();
+            pending.clear();
+            for (std::size_t i = 0; i < merged.size(); ++i) {
+                append(merged.val[i], merged.time[i]);
+            }
+        }
+
+        // вызывает f(last, bytes, spill) для каждого блока в куче, закончившегося до before;
+        // spill() переносит блок в холодное хранилище
+        template<typename F>
+        void spillCandidates(time_point before, ColdStore &store, F &&f) {
+            for (auto &b: blocks) {
+                if (b->last >= before) {
+                    break;
+                }
+                if (!b->cold()) {
+                    f(b->last, b->heapBytes(), [&b, &store]() {
+                        b = std::make_shared<Block<T>>(b->spill(store));
+                    });
+                }
+            }
+        }
+
+        void coldSegments(std::vector<std::shared_ptr<Segment>> &segments) const {
+            for (auto const &b: blocks) {
+                if (b->cold() && (segments.empty() || segments.back() != b->segment)) {
+                    segments.push_back(b->segment);
+                }
+            }
+        }
+
+        std::size_t heapBytes() const {
+            std::size_t bytes = 0;
+            for (auto const &b: blocks) {
+                bytes += b->heapBytes();
+            }
+            return bytes;
+        }
+
+        void setLateness(seconds value) {
+            lateness = value;
+        }
+
+        // сроки хранения; незаданный срок - хранить всегда
+        void setRetention(Retention value) {
+            retention = value;
+        }
+
+        // скетчи квантилей в часовой и суточной свёртках; минутная их не ведёт:
+        // квантили за короткие интервалы считаются по исходным значениям
+        void setQuantiles(bool value) {
+            rollups[0].setDigests(false);
+            rollups[1].setDigests(value);
+            rollups[2].setDigests(value);
+        }
+
+        // количество значений, отброшенных из-за слишком позднего прихода
+        std::uint64_t droppedLate() const {
+            return dropped;
+        }
+
+        bool empty() const {
+            return blocks.empty() && head.empty() && pending.empty();
+        }
+
+        std::size_t size() const {
+            return blocks.size() * blockSize + head.size() + pending.size();
+        }
+
+        template<class Archive>
+        void save(Archive &ar) const {
+            ar(static_cast<std::uint64_t>(blocks.size()));
+            for (auto const &b: blocks) {
+                ar(*b);
+            }
+            ar(head, pending, newest, dropped, rollups);
+        }
+
+        template<class Archive>
+        void load(Archive &ar) {
+            std::uint64_t size;
+            ar(size);
+            blocks.clear();
+            for (std::uint64_t i = 0; i < size; ++i) {
+                auto b = std::make_shared<Block<T>>();
+                ar(*b);
+                blocks.push_back(std::move(b));
+            }
+            ar(head, pending, newest, dropped, rollups);
+        }
+
+    private:
+        void append(T val, time_point time) {
+            if (head.time.capacity() < blockSize) {
+                head.reserve(blockSize);
+            }
+            head.push_back(val, time);
+            if (head.size() == blockSize) {
+                blocks.push_back(std::make_shared<Block<T>>(
+                        Block<T>::encode(head, 0, head.size())));
+                head.clear();
+            }
+        }
+
+        // слияние отсортированных значений; при равном времени опоздавшие идут последними
+        static void mergeInto(Column<T> &out, Column<T> const &sorted,
+                std::vector<Timestamp<T>> const &late) {
+            out.reserve(out.size() + sorted.size() + late.size());
+            std::size_t i = 0;
+            for (auto const &l: late) {
+                for (; i < sorted.size() && sorted.time[i] <= l.time; ++i) {
+                    out.time.push_back(sorted.time[i]);
+                    out.val.push_back(sorted.val[i]);
+                }
+                out.push_back(l.val, l.time);
+            }
+            out.append(sorted, i, sorted.size());
+        }
+
+        std::deque<std::shared_ptr<Block<T> const>> blocks;
+        Column<T> head;
+        std::vector<Timestamp<T>> pending;
+        // самое позднее из принятых значений; до первого - любое значение новее
+        time_point newest = time_point::min();
+        seconds lateness = std::chrono::hours(24);
+        Retention retention;
+        std::uint64_t dropped = 0;
+        std::array<Rollup<T>, 3> rollups{
+                Rollup<T>(std::chrono::minutes(1)),
+                Rollup<T>(std::chrono::hours(1)),
+                Rollup<T>(std::chrono::hours(24)),
+        };
+    };
+}
@@ -0,0 +1,240 @@
+#include "Snapshot.hpp"
+#include "Log.hpp"
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+#include <array>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // снимок из разделов: заголовок, метаданные со связями, по разделу на каждый ряд
+    // и в конце - индекс разделов, смещение которого записано в заголовке.
+    // Заголовок - "SNSNAP" и две цифры версии формата (impl::SnapshotFormat)
+    char const magic[6] = {'S', 'N', 'S', 'N', 'A', 'P'};
+    constexpr std::size_t headerSize = sizeof(magic) + 2;
+
+    std::array<char, headerSize> header(unsigned format) {
+        std::array<char, headerSize> h{};
+        std::memcpy(h.data(), magic, sizeof(magic));
+        h[sizeof(magic)] = char('0' + format / 10 % 10);
+        h[sizeof(magic) + 1] = char('0' + format % 10);
+        return h;
+    }
+
+    struct Section {
+        std::uint64_t offset;
+        std::uint64_t size;
+
+        template<class Archive>
+        void serialize(Archive &ar) {
+            ar(offset, size);
+        }
+    };
+
+    void fileSync(std::string const &path) {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+    }
+}
+
+Snapshots::~Snapshots() {
+    if (job.valid()) {
+        job.wait();
+    }
+}
+
+std::uint64_t Snapshots::load() {
+    std::uint64_t generation = 0;
+    if (!std::filesystem::exists(path)) {
+        return generation;
+    }
+
+    std::ifstream is(path, std::ios::binary);
+    char head[headerSize] = {};
+    is.read(head, sizeof(head));
+    bool const sectioned = is && std::memcmp(head, magic, sizeof(magic)) == 0 &&
+            std::isdigit(static_cast<unsigned char>(head[sizeof(magic)])) &&
+            std::isdigit(static_cast<unsigned char>(head[sizeof(magic) + 1]));
+    if (!sectioned) {
+        // файл без заголовка записан первыми версиями: ряды в нём - векторы значений,
+        // журнала тогда не было
+        is.clear();
+        is.seekg(0);
+        cereal::BinaryInputArchive iarchive(is);
+        impl::FormatScope scope(impl::LegacyFormat);
+        iarchive(*capabilities, *map);
+        relations->loadLegacy(iarchive);
+        LOG(Info, "Converted snapshot without a header, the next one is saved in format "
+                << impl::currentFormat);
+        return generation;
+    }
+
+    unsigned const format = (head[sizeof(magic)] - '0') * 10 + (head[sizeof(magic) + 1] - '0');
+    if (format < impl::SectionedFormat || format > impl::currentFormat) {
+        throw std::runtime_error("snapshot format " + std::to_string(format) +
+                " is not supported by this version");
+    }
+
+    std::uint64_t indexOffset;
+    is.read(reinterpret_cast<char *>(&indexOffset), sizeof(indexOffset));
+    is.seekg(indexOffset);
+    std::vector<Section> sections;
+    {
+        cereal::BinaryInputArchive iarchive(is);
+        iarchive(sections);
+    }
+
+    // метаданные нужны сразу, ряды читаются в фоне или при первом обращении
+    is.seekg(sections.at(0).offset);
+    cereal::BinaryInputArchive iarchive(is);
+    std::vector<std::shared_ptr<impl::Storage>> series;
+    {
+        impl::FormatScope scope(format);
+        iarchive(*capabilities, *map);
+        relations->loadLinks(iarchive, series);
+        iarchive(generation);
+    }
+
+    if (sections.size() != series.size() + 1) {
+        throw std::runtime_error("snapshot index does not match its series");
+    }
+    relations->loadSeries(std::move(series), [path = path, sections, format](std::size_t i,
+            impl::Storage &s) {
+        std::ifstream is(path, std::ios::binary);
+        is.seekg(sections[i + 1].offset);
+        cereal::BinaryInputArchive iarchive(is);
+        impl::FormatScope scope(format);
+        iarchive(s);
+    }, std::thread::hardware_concurrency());
+    return generation;
+}
+
+bool Snapshots::start() {
+    if (job.valid()) {
+        if (job.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+        finish();
+    }
+
+    struct State {
+        Capabilities capabilities;
+        DeviceMap map;
+        Relations relations;
+        std::uint64_t generation;
+    };
+    auto begin = std::chrono::steady_clock::now();
+    auto state = std::make_shared<State>(State{*capabilities, *map, relations->snapshot(),
+            journal != nullptr ? journal->rotate() : 0});
+
+    // msync холодных сегментов - дисковый ввод-вывод, поэтому он идёт в задаче, а не под
+    // блокировкой состояния вызывающего; блоки копии держат свои сегменты живыми
+    job = std::async(std::launch::async, [state, begin, path = path, coldStore = coldStore]() {
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream os(tmp, std::ios::binary);
+            std::uint64_t indexOffset = 0;
+            os.write(header(impl::currentFormat).data(), headerSize);
+            os.write(reinterpret_cast<char const *>(&indexOffset), sizeof(indexOffset));
+
+            std::vector<Section> sections;
+            auto section = [&os, &sections](auto &&write) {
+                std::uint64_t offset = os.tellp();
+                {
+                    cereal::BinaryOutputArchive oarchive(os);
+                    write(oarchive);
+                }
+                sections.push_back({offset, std::uint64_t(os.tellp()) - offset});
+            };
+
+            std::vector<std::shared_ptr<impl::Storage>> series;
+            section([&](auto &oarchive) {
+                oarchive(state->capabilities, state->map);
+                state->relations.saveLinks(oarchive, series);
+                oarchive(state->generation);
+            });
+            for (auto const &s: series) {
+                section([&s](auto &oarchive) { oarchive(*s); });
+            }
+
+            indexOffset = os.tellp();
+            {
+                cereal::BinaryOutputArchive oarchive(os);
+                oarchive(sections);
+            }
+            os.seekp(headerSize);
+            os.write(reinterpret_cast<char const *>(&indexOffset), sizeof(indexOffset));
+            os.flush();
+            if (!os) {
+                throw std::runtime_error("cannot write snapshot '" + tmp + "'");
+            }
+        }
+        fileSync(tmp);
+        if (coldStore != nullptr) {
+            coldStore->sync();
+        }
+        std::filesystem::rename(tmp, path);
+
+        Result result;
+        result.generation = state->generation;
+        result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - begin);
+        result.bytes = std::filesystem::file_size(path);
+        state->relations.coldSegments(result.segments);
+        return result;
+    });
+    return true;
+}
+
+void Snapshots::wait() {
+    if (job.valid()) {
+        finish();
+    }
+}
+
+void Snapshots::finish() {
+    try {
+        auto result = job.get();
+        ++last.count;
+        last.duration = result.duration;
+        last.bytes = result.bytes;
+        pinned = std::move(result.segments);
+
+        // всё, что было в журнале до снимка, и сегменты, на которые не ссылаются
+        // ни снимок, ни текущие данные, больше не нужны
+        if (journal != nullptr) {
+            journal->release(result.generation);
+        }
+        if (coldStore != nullptr) {
+            coldStore->collect();
+        }
+        LOG(Info, "Saving data... (" << result.bytes << " bytes in " << result.duration.count()
+                << " ms, late samples dropped: " << relations->droppedLate() << ")");
+    }
+    catch (std::exception const &e) {
+        LOG(Error, "SNAPSHOT ERROR: " << e.what());
+    }
+}
+
+Snapshots::Stats Snapshots::stats() {
+    if (job.valid() && job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        finish();
+    }
+    auto stats = last;
+    stats.running = job.valid();
+    return stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Relations.hpp"
+#include "Journal.hpp"
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+
+// снимки состояния: копия делается в потоке событий, а записывается в фоновом потоке
+// во временный файл, который затем атомарно заменяет предыдущий снимок
+class Snapshots {
+public:
+    struct Stats {
+        std::uint64_t count = 0;
+        bool running = false;
+        std::chrono::milliseconds duration{};  // последнего сохранения
+        std::uintmax_t bytes = 0;
+    };
+
+    Snapshots(std::string path, Capabilities *capabilities, DeviceMap *map, Relations *relations) :
+            path(std::move(path)), capabilities(capabilities), map(map), relations(relations) {}
+
+    Snapshots(Snapshots const &) = delete;
+
+    Snapshots &operator=(Snapshots const &) = delete;
+
+    ~Snapshots();
+
+    void setJournal(Journal *value) {
+        journal = value;
+    }
+
+    void setColdStore(impl::ColdStore *value) {
+        coldStore = value;
+    }
+
+    // загружает метаданные последнего снимка, если он есть, а ряды оставляет читаться
+    // в фоновых потоках; возвращает поколение журнала, с которого начинаются
+    // не вошедшие в снимок записи
+    std::uint64_t load();
+
+    // начинает сохранение; false, если предыдущее ещё не закончилось
+    bool start();
+
+    // дожидается окончания текущего сохранения
+    void wait();
+
+    Stats stats();
+
+private:
+    struct Result {
+        std::uint64_t generation;
+        std::chrono::milliseconds duration;
+        std::uintmax_t bytes;
+        std::vector<std::shared_ptr<impl::Segment>> segments;
+    };
+
+    void finish();
+
+    std::string path;
+    Capabilities *capabilities;
+    DeviceMap *map;
+    Relations *relations;
+    Journal *journal = nullptr;
+    impl::ColdStore *coldStore = nullptr;
+    std::future<Result> job;
+    Stats last;
+    // сегменты, на которые ссылается последний сохранённый снимок
+    std::vector<std::shared_ptr<impl::Segment>> pinned;
+};
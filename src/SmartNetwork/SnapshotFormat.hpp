@@ -0,0 +1,35 @@
+#pragma once
+
+namespace impl {
+    // версии формата снимка; номер записан двумя цифрами в конце заголовка "SNSNAP.."
+    enum SnapshotFormat : unsigned {
+        // файл без заголовка, который первые версии записывали cereal целиком:
+        // ряды - векторы значений, у типов устройств и показателей нет сроков хранения
+        LegacyFormat = 0,
+        // разделы по рядам, ряды из сжатых блоков со свёртками, сроки хранения
+        SectionedFormat = 1,
+        currentFormat = SectionedFormat,
+    };
+
+    // формат снимка, который читается на этом потоке; записывается всегда текущий
+    inline thread_local unsigned snapshotFormat = currentFormat;
+
+    // выставляет формат читаемого снимка на время чтения
+    class FormatScope {
+    public:
+        explicit FormatScope(unsigned format) : previous(snapshotFormat) {
+            snapshotFormat = format;
+        }
+
+        FormatScope(FormatScope const &) = delete;
+
+        FormatScope &operator=(FormatScope const &) = delete;
+
+        ~FormatScope() {
+            snapshotFormat = previous;
+        }
+
+    private:
+        unsigned previous;
+    };
+}
@@ -0,0 +1,184 @@
+#include "Subscriptions.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    double number(Subscriptions::Value const &value) {
+        return std::visit([](auto v) { return double(v); }, value);
+    }
+}
+
+std::uint64_t Subscriptions::add(Subscriber subscriber, std::string name,
+        std::vector<Device> devices, std::optional<Location> location, Filter filter,
+        Find const &find) {
+    std::lock_guard lock(mutex);
+    auto id = nextId++;
+    auto &s = subscriptions[id];
+    s.subscriber = subscriber;
+    s.name = std::move(name);
+    s.filter = filter;
+    s.location = std::move(location);
+    bind(id, s, std::move(devices), find);
+    count.store(subscriptions.size(), std::memory_order_relaxed);
+    return id;
+}
+
+void Subscriptions::bind(std::uint64_t id, Subscription &s, std::vector<Device> devices,
+        Find const &find) {
+    for (auto k: s.keys) {
+        unindex(k, id);
+    }
+    s.keys.clear();
+    for (auto it = s.states.begin(); it != s.states.end();) {
+        if (std::find(devices.begin(), devices.end(), it->first) == devices.end()) {
+            it = s.states.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    s.devices = std::move(devices);
+    for (auto device: s.devices) {
+        if (auto indicator = find(device, s.name)) {
+            s.keys.push_back(key(device, *indicator));
+            index[s.keys.back()].push_back(id);
+        }
+    }
+}
+
+void Subscriptions::unindex(std::uint64_t k, std::uint64_t id) {
+    auto i = index.find(k);
+    if (i == index.end()) {
+        return;
+    }
+    auto &ids = i->second;
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+    if (ids.empty()) {
+        index.erase(i);
+    }
+}
+
+void Subscriptions::erase(std::unordered_map<std::uint64_t, Subscription>::iterator it) {
+    for (auto k: it->second.keys) {
+        unindex(k, it->first);
+    }
+    subscriptions.erase(it);
+    count.store(subscriptions.size(), std::memory_order_relaxed);
+}
+
+bool Subscriptions::remove(Subscriber subscriber, std::uint64_t id) {
+    std::lock_guard lock(mutex);
+    auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || it->second.subscriber != subscriber) {
+        return false;
+    }
+    erase(it);
+    return true;
+}
+
+void Subscriptions::removeAll(Subscriber subscriber) {
+    std::lock_guard lock(mutex);
+    for (auto it = subscriptions.begin(); it != subscriptions.end();) {
+        auto next = std::next(it);
+        if (it->second.subscriber == subscriber) {
+            erase(it);
+        }
+        it = next;
+    }
+}
+
+void Subscriptions::rebind(Device device, Find const &find) {
+    std::lock_guard lock(mutex);
+    for (auto &[id, s]: subscriptions) {
+        if (std::find(s.devices.begin(), s.devices.end(), device) != s.devices.end()) {
+            bind(id, s, s.devices, find);
+        }
+    }
+}
+
+void Subscriptions::relocate(Locate const &locate, Find const &find) {
+    std::lock_guard lock(mutex);
+    for (auto &[id, s]: subscriptions) {
+        if (s.location) {
+            bind(id, s, locate(*s.location), find);
+        }
+    }
+}
+
+void Subscriptions::forget(Device device, Find const &find) {
+    std::lock_guard lock(mutex);
+    for (auto &[id, s]: subscriptions) {
+        if (s.location) {
+            continue;
+        }
+        auto devices = s.devices;
+        devices.erase(std::remove(devices.begin(), devices.end(), device), devices.end());
+        if (devices.size() != s.devices.size()) {
+            bind(id, s, std::move(devices), find);
+        }
+    }
+}
+
+void Subscriptions::sample(Device device, Indicator indicator, Value value, time_point time) {
+    std::lock_guard lock(mutex);
+    auto i = index.find(key(device, indicator));
+    if (i == index.end()) {
+        return;
+    }
+    auto now = clock::now();
+    for (auto id: i->second) {
+        auto &s = subscriptions.at(id);
+        auto &state = s.states[device];
+        auto v = number(value);
+        // значение вернулось к отправленному: задержанное больше не нужно
+        if (s.filter.deadband && state.sent && std::abs(v - state.last) <= *s.filter.deadband) {
+            state.pending.reset();
+            continue;
+        }
+        if (state.sent && now - state.sentAt < s.filter.minInterval) {
+            if (!state.pending) {
+                waiting.emplace_back(id, device);
+            }
+            state.pending.emplace(time, value);
+            continue;
+        }
+        state.sent = true;
+        state.last = v;
+        state.sentAt = now;
+        state.pending.reset();
+        ready.push_back({s.subscriber, id, device, s.name, time, value});
+    }
+}
+
+std::vector<Subscriptions::Notice> Subscriptions::take(clock::time_point now) {
+    std::lock_guard lock(mutex);
+    std::vector<std::pair<std::uint64_t, Device>> later;
+    for (auto [id, device]: waiting) {
+        auto it = subscriptions.find(id);
+        if (it == subscriptions.end()) {
+            continue;
+        }
+        auto &s = it->second;
+        auto st = s.states.find(device);
+        if (st == s.states.end() || !st->second.pending) {
+            continue;
+        }
+        auto &state = st->second;
+        if (now - state.sentAt < s.filter.minInterval) {
+            later.emplace_back(id, device);
+            continue;
+        }
+        auto [time, value] = *state.pending;
+        state.pending.reset();
+        state.last = number(value);
+        state.sentAt = now;
+        ready.push_back({s.subscriber, id, device, s.name, time, value});
+    }
+    waiting.swap(later);
+
+    std::vector<Notice> result;
+    result.swap(ready);
+    std::stable_sort(result.begin(), result.end(), [](auto const &l, auto const &r) {
+        return l.id < r.id;
+    });
+    return result;
+}
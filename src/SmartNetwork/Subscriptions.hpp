@@ -0,0 +1,124 @@
+#pragma once
+
+#include "DeviceMap.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// подписки соединений на показатели устройств: новые значения передаются подписчику
+// сразу из Relations::transmit, без запросов history. Значение отправляется, только если
+// оно отличается от последнего отправленного больше чем на deadband, и не чаще minInterval;
+// задержанное интервалом значение (последнее из пришедших) уходит, когда интервал истечёт.
+// Подписка держится за имя показателя: при смене режима устройства показатель ищется заново.
+// Подписка на расположение хранит шаблон и заново находит устройства, когда они
+// добавляются, переезжают или удаляются
+class Subscriptions {
+public:
+    using Subscriber = std::uint64_t;
+    using Value = std::variant<int, float, bool>;
+    using clock = std::chrono::steady_clock;
+
+    // показатель с именем name в текущем режиме устройства
+    using Find = std::function<std::optional<Indicator>(Device, std::string const &)>;
+
+    // шаблон расположения, как у find_device
+    struct Location {
+        std::string pattern;
+        bool match = true;
+    };
+
+    // устройства, подходящие под расположение
+    using Locate = std::function<std::vector<Device>(Location const &)>;
+
+    struct Filter {
+        std::optional<double> deadband;
+        std::chrono::milliseconds minInterval{};
+    };
+
+    // значение для отправки подписчику
+    struct Notice {
+        Subscriber subscriber;
+        std::uint64_t id;
+        Device device;
+        std::string name;
+        time_point time;
+        Value value;
+    };
+
+    // подписка на показатель name устройств devices, найденных по location, если оно есть;
+    // возвращает номер подписки
+    std::uint64_t add(Subscriber subscriber, std::string name, std::vector<Device> devices,
+            std::optional<Location> location, Filter filter, Find const &find);
+
+    bool remove(Subscriber subscriber, std::uint64_t id);
+
+    // все подписки закрытого соединения
+    void removeAll(Subscriber subscriber);
+
+    // устройство перешло в другой режим. Если показателя с именем подписки там нет,
+    // подписка молчит, пока режим с таким показателем не вернётся
+    void rebind(Device device, Find const &find);
+
+    // устройства добавлены, переехали или удалены: подписки на расположение
+    // находят свои устройства заново
+    void relocate(Locate const &locate, Find const &find);
+
+    // устройство удалено: подписки на него по номеру его больше не получают
+    void forget(Device device, Find const &find);
+
+    bool empty() const {
+        return count.load(std::memory_order_relaxed) == 0;
+    }
+
+    void sample(Device device, Indicator indicator, Value value, time_point time);
+
+    // значения, которые пора отправить, по подпискам в порядке поступления
+    std::vector<Notice> take(clock::time_point now = clock::now());
+
+private:
+    struct State {
+        bool sent = false;
+        double last = 0;
+        clock::time_point sentAt;
+        std::optional<std::pair<time_point, Value>> pending;
+    };
+
+    struct Subscription {
+        Subscriber subscriber;
+        std::string name;
+        Filter filter;
+        std::optional<Location> location;
+        std::vector<Device> devices;
+        // показатели устройств в их текущем режиме
+        std::vector<std::uint64_t> keys;
+        std::unordered_map<Device, State> states;
+    };
+
+    static std::uint64_t key(Device device, Indicator indicator) {
+        return std::uint64_t(device) << 32 | indicator;
+    }
+
+    void unindex(std::uint64_t k, std::uint64_t id);
+
+    // связывает подписку с устройствами devices; состояния прочих устройств забываются
+    void bind(std::uint64_t id, Subscription &s, std::vector<Device> devices, Find const &find);
+
+    void erase(std::unordered_map<std::uint64_t, Subscription>::iterator it);
+
+    std::mutex mutex;
+    std::atomic<std::size_t> count{0};
+    std::uint64_t nextId = 1;
+    std::unordered_map<std::uint64_t, Subscription> subscriptions;
+    // устройство и показатель -> подписки на них
+    std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> index;
+    std::vector<Notice> ready;
+    // подписки и устройства с задержанными значениями, могут повторяться
+    std::vector<std::pair<std::uint64_t, Device>> waiting;
+};
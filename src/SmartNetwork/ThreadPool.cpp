@@ -0,0 +1,45 @@
+#include "ThreadPool.hpp"
+#include "Log.hpp"
+
+ThreadPool::ThreadPool(unsigned threads) {
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+        workers.emplace_back([this]() {
+            std::unique_lock lock(mutex);
+            while (true) {
+                ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                auto task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                try {
+                    task();
+                }
+                catch (std::exception const &e) {
+                    LOG(Error, "task error: " << e.what());
+                }
+                lock.lock();
+            }
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto &w: workers) {
+        w.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    ready.notify_one();
+}
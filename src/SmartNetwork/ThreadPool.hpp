@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// пул потоков для тяжёлых запросов, чтобы не занимать поток событий
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+
+    ThreadPool(ThreadPool const &) = delete;
+
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    // дожидается уже поставленных задач
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    std::size_t size() const {
+        return workers.size();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
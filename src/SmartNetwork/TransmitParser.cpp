@@ -0,0 +1,176 @@
+#include "TransmitParser.hpp"
+#include <limits>
+
+namespace {
+    template<typename E>
+    unsigned bit(E e) {
+        return 1u << unsigned(e);
+    }
+}
+
+bool TransmitParser::parse(std::string_view text) {
+    place = Place::Start;
+    field = Field::None;
+    seen = 0;
+    count = 0;
+
+    auto const required = bit(Field::CommandName) | bit(Field::DeviceId) | bit(Field::Time) |
+            bit(Field::Data);
+    return nlohmann::json::sax_parse(text.begin(), text.end(), this) && place == Place::Done &&
+            seen == required;
+}
+
+bool TransmitParser::scalar(Value value) {
+    auto f = field;
+    field = Field::None;
+    switch (f) {
+        case Field::DeviceId:
+            if (auto v = std::get_if<std::uint64_t>(&value)) {
+                if (*v <= std::numeric_limits<Device>::max()) {
+                    deviceId = Device(*v);
+                    return true;
+                }
+            }
+            return false;
+        case Field::Value:
+            data[count].value = value;
+            hasValue = true;
+            return true;
+        case Field::Ignored:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool TransmitParser::null() {
+    auto f = field;
+    field = Field::None;
+    return f == Field::Ignored;
+}
+
+bool TransmitParser::boolean(bool val) {
+    return scalar(val);
+}
+
+bool TransmitParser::number_integer(std::int64_t val) {
+    return scalar(val);
+}
+
+bool TransmitParser::number_unsigned(std::uint64_t val) {
+    return scalar(val);
+}
+
+bool TransmitParser::number_float(double val, string_t const &) {
+    return scalar(val);
+}
+
+bool TransmitParser::string(string_t &val) {
+    auto f = field;
+    field = Field::None;
+    switch (f) {
+        case Field::CommandName:
+            return val == "transmit_data";
+        case Field::Time:
+            timeText = val;
+            return true;
+        case Field::Name:
+            data[count].name = val;
+            hasName = true;
+            return true;
+        case Field::Ignored:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool TransmitParser::binary(binary_t &) {
+    return false;
+}
+
+bool TransmitParser::start_object(std::size_t) {
+    if (place == Place::Start) {
+        place = Place::Top;
+        return true;
+    }
+    if (place == Place::Array) {
+        if (data.size() == count) {
+            data.emplace_back();
+        }
+        hasName = false;
+        hasValue = false;
+        place = Place::Item;
+        return true;
+    }
+    return false;
+}
+
+bool TransmitParser::key(string_t &val) {
+    if (place == Place::Top) {
+        if (val == "command_name") {
+            field = Field::CommandName;
+        } else if (val == "device_id") {
+            field = Field::DeviceId;
+        } else if (val == "time") {
+            field = Field::Time;
+        } else if (val == "data") {
+            field = Field::Data;
+        } else {
+            return false;
+        }
+        // повтор поля в Json означал бы замену значения, такое проще разобрать обычным путём
+        if (seen & bit(field)) {
+            return false;
+        }
+        seen |= bit(field);
+        return true;
+    }
+
+    if (place == Place::Item) {
+        if (val == "name") {
+            field = Field::Name;
+        } else if (val == "value") {
+            field = Field::Value;
+        } else {
+            field = Field::Ignored;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool TransmitParser::end_object() {
+    if (place == Place::Item && hasName && hasValue) {
+        ++count;
+        place = Place::Array;
+        return true;
+    }
+    if (place == Place::Top) {
+        place = Place::Done;
+        return true;
+    }
+    return false;
+}
+
+bool TransmitParser::start_array(std::size_t) {
+    if (place == Place::Top && field == Field::Data) {
+        field = Field::None;
+        place = Place::Array;
+        return true;
+    }
+    return false;
+}
+
+bool TransmitParser::end_array() {
+    if (place == Place::Array) {
+        place = Place::Top;
+        return true;
+    }
+    return false;
+}
+
+bool TransmitParser::parse_error(std::size_t, std::string const &,
+        nlohmann::detail::exception const &) {
+    return false;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "DeviceMap.hpp"
+
+// разбор команды transmit_data прямо из текста сообщения, без дерева Json:
+// {"command_name": "transmit_data", "device_id": ..., "time": ..., "data": [{"name": ..., "value": ...}]}.
+// Любое отличие от этого вида (другая команда, лишние поля, вложенные значения) прерывает
+// разбор, и сообщение обрабатывается обычным путём
+class TransmitParser {
+public:
+    // значение в том виде, в каком оно записано в сообщении
+    using Value = std::variant<std::int64_t, std::uint64_t, double, bool>;
+
+    struct Sample {
+        std::string name;
+        Value value;
+    };
+
+    // true - сообщение разобрано целиком; буферы переиспользуются между вызовами
+    bool parse(std::string_view text);
+
+    Device device() const {
+        return deviceId;
+    }
+
+    std::string const &time() const {
+        return timeText;
+    }
+
+    // значения сообщения - первые size() элементов
+    std::vector<Sample> const &samples() const {
+        return data;
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    // события разбора для nlohmann::json::sax_parse
+
+    using string_t = nlohmann::json::string_t;
+    using binary_t = nlohmann::json::binary_t;
+
+    bool null();
+
+    bool boolean(bool val);
+
+    bool number_integer(std::int64_t val);
+
+    bool number_unsigned(std::uint64_t val);
+
+    bool number_float(double val, string_t const &);
+
+    bool string(string_t &val);
+
+    bool binary(binary_t &);
+
+    bool start_object(std::size_t);
+
+    bool key(string_t &val);
+
+    bool end_object();
+
+    bool start_array(std::size_t);
+
+    bool end_array();
+
+    bool parse_error(std::size_t, std::string const &, nlohmann::detail::exception const &);
+
+private:
+    enum class Field {
+        None,
+        CommandName,
+        DeviceId,
+        Time,
+        Data,
+        Name,
+        Value,
+        Ignored,
+    };
+
+    enum class Place {
+        Start,
+        Top,
+        Array,
+        Item,
+        Done,
+    };
+
+    bool scalar(Value value);
+
+    Place place = Place::Start;
+    Field field = Field::None;
+    // поля верхнего уровня, уже встреченные в сообщении
+    unsigned seen = 0;
+    bool hasName = false;
+    bool hasValue = false;
+
+    Device deviceId = 0;
+    std::string timeText;
+    std::vector<Sample> data;
+    std::size_t count = 0;
+};
@@ -6,12 +6,220 @@
 #include <websocketpp/client.hpp>
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/config/asio_no_tls_client.hpp>
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <nlohmann/json.hpp>
+#include <zlib.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include "DeviceMap.hpp"
+#include "Log.hpp"
+#include "Protocol.hpp"
 
 using Json = nlohmann::json;
 
-template<typename M, typename F, typename S>
-void messageHandler(S &&send, F &&callback, websocketpp::connection_hdl hdl, M msg) {
+// настройки соединений, ноль - без ограничения
+struct ConnectionSettings {
+    std::size_t maxConnections = 0;
+    // соединение без сообщений дольше этого закрывается
+    int idleSeconds = 0;
+    // ответы соединению копятся не дольше coalesceMs миллисекунд и не больше coalesceBytes
+    // байт и уходят одним кадром-массивом; при coalesceMs = 0 каждый ответ уходит сразу
+    int coalesceMs = 0;
+    std::size_t coalesceBytes = 64 * 1024;
+    // пока в очереди отправки соединения больше highWater байт, его сообщения не читаются
+    std::size_t highWater = 0;
+    // ответ history частями считает следующую часть, только когда в очереди отправки
+    // соединения, включая ещё не отправленные накопленные ответы, не больше streamWindow байт
+    std::size_t streamWindow = 1024 * 1024;
+    // сжатие permessage-deflate, если другая сторона его поддерживает;
+    // deflateLevel - уровень zlib от 0 до 9, -1 - уровень websocketpp по умолчанию
+    bool deflate = false;
+    int deflateLevel = -1;
+    // как часто отправляются значения подписок, задержанные их интервалом
+    int notifyMs = 100;
+};
+
+// задаются в setup до запуска обработчиков и дальше только читаются
+ConnectionSettings connectionSettings;
+
+// permessage-deflate из websocketpp, но со своим уровнем сжатия для исходящих сообщений
+// сервера. Окно и сброс словаря берутся из ответа на предложение клиента; клиентская сторона
+// и уровень по умолчанию сжимаются самим websocketpp
+template<typename config>
+class TunedDeflate : public websocketpp::extensions::permessage_deflate::enabled<config> {
+    using Base = websocketpp::extensions::permessage_deflate::enabled<config>;
+
+public:
+    TunedDeflate() = default;
+
+    TunedDeflate(TunedDeflate const &) = delete;
+
+    TunedDeflate &operator=(TunedDeflate const &) = delete;
+
+    ~TunedDeflate() {
+        if (own) {
+            deflateEnd(&stream);
+        }
+    }
+
+    websocketpp::err_str_pair negotiate(websocketpp::http::attribute_list const &offer) {
+        auto r = Base::negotiate(offer);
+        auto bits = r.second.find("server_max_window_bits=");
+        if (bits != std::string::npos) {
+            windowBits = std::atoi(r.second.c_str() + bits + 23);
+        }
+        resetEach = r.second.find("server_no_context_takeover") != std::string::npos;
+        return r;
+    }
+
+    websocketpp::lib::error_code init(bool isServer) {
+        auto ec = Base::init(isServer);
+        int level = connectionSettings.deflateLevel;
+        if (ec || !isServer || level < 0 || own) {
+            return ec;
+        }
+        // окно в 256 байт zlib не поддерживает, тогда сжимает websocketpp
+        own = deflateInit2(&stream, std::min(level, 9), Z_DEFLATED, -windowBits, 8,
+                Z_DEFAULT_STRATEGY) == Z_OK;
+        return ec;
+    }
+
+    websocketpp::lib::error_code compress(std::string const &in, std::string &out) {
+        if (!own) {
+            return Base::compress(in, out);
+        }
+        if (resetEach) {
+            deflateReset(&stream);
+        }
+        unsigned char buffer[16384];
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        stream.avail_in = uInt(in.size());
+        do {
+            stream.next_out = buffer;
+            stream.avail_out = sizeof(buffer);
+            deflate(&stream, Z_SYNC_FLUSH);
+            out.append(reinterpret_cast<char *>(buffer), sizeof(buffer) - stream.avail_out);
+        } while (stream.avail_out == 0);
+        // пустой блок 00 00 ff ff в конце сообщения не передаётся (RFC 7692)
+        out.resize(out.size() - 4);
+        return {};
+    }
+
+private:
+    z_stream stream{};
+    bool own = false;
+    int windowBits = 15;
+    bool resetEach = false;
+};
+
+// конфигурация websocketpp с permessage-deflate поверх Base
+template<typename Base>
+struct DeflateConfig : Base {
+    typedef DeflateConfig type;
+
+    struct permessage_deflate_config {
+    };
+
+    typedef TunedDeflate<permessage_deflate_config> permessage_deflate_type;
+};
+
+// состояние одного соединения
+struct Session {
+    // номер соединения, по нему доставляются уведомления подписок
+    std::uint64_t id = 0;
+    Encoding encoding = Encoding::Json;
+    std::chrono::steady_clock::time_point lastActive = std::chrono::steady_clock::now();
+    // устройства-получатели, подключённые через это соединение (команда attach)
+    std::set<Device> devices;
+    // передачи другим соединениям, накопленные за разбор одного сообщения
+    std::vector<Json> outbox;
+    // ответы, ждущие отправки одним кадром, и таймер их отправки
+    Batch pending;
+    bool flushScheduled = false;
+    std::shared_ptr<boost::asio::steady_timer> flushTimer;
+    // чтение приостановлено, пока другая сторона не заберёт отправленное
+    bool paused = false;
+    std::shared_ptr<boost::asio::steady_timer> drainTimer;
+};
+
+using Sessions = std::map<websocketpp::connection_hdl, Session,
+        std::owner_less<websocketpp::connection_hdl>>;
+
+// открытые соединения; обработчики одного соединения websocketpp выполняет по очереди,
+// а разных - в разных потоках, поэтому sessions, owners и чужие сессии - под sessionsMutex
+Sessions sessions;
+
+// соединение, через которое подключено устройство-получатель
+std::unordered_map<Device, websocketpp::connection_hdl> owners;
+
+// соединения по номерам
+std::unordered_map<std::uint64_t, websocketpp::connection_hdl> sessionIds;
+std::uint64_t lastSessionId = 0;
+
+std::mutex sessionsMutex;
+
+inline bool sameConnection(websocketpp::connection_hdl const &l,
+        websocketpp::connection_hdl const &r) {
+    return !l.owner_before(r) && !r.owner_before(l);
+}
+
+// соединение, которому нужно передать команду для устройства, кроме самого отправителя;
+// вызывается под sessionsMutex, как и attach
+inline Session *ownerSession(Device device, websocketpp::connection_hdl const &sender) {
+    auto it = owners.find(device);
+    if (it == owners.end() || sameConnection(it->second, sender)) {
+        return nullptr;
+    }
+    auto session = sessions.find(it->second);
+    return session == sessions.end() ? nullptr : &session->second;
+}
+
+// attach/detach: соединение берёт на себя доставку команд перечисленным устройствам
+inline Json attach(websocketpp::connection_hdl const &hdl, Session &session, Json const &json,
+        bool detach) {
+    Json r;
+    r["command_name"] = detach ? "detach" : "attach";
+    for (auto const &d: json["devices"]) {
+        auto device = d.get<Device>();
+        if (detach) {
+            session.devices.erase(device);
+            auto it = owners.find(device);
+            if (it != owners.end() && sameConnection(it->second, hdl)) {
+                owners.erase(it);
+            }
+        } else {
+            // устройство переходит к последнему подключившему его соединению
+            auto it = owners.find(device);
+            if (it != owners.end()) {
+                auto previous = sessions.find(it->second);
+                if (previous != sessions.end()) {
+                    previous->second.devices.erase(device);
+                }
+            }
+            owners[device] = hdl;
+            session.devices.insert(device);
+        }
+    }
+    r["devices"] = session.devices;
+    return r;
+}
+
+// route(e) - передать элемент ответа другому соединению, false - ответить отправителю
+// drain(next) - вызвать next, когда очередь отправки соединения освободится
+template<typename M, typename F, typename S, typename R, typename D>
+void messageHandler(S &&send, R &&route, F &&callback, D &&drain,
+        websocketpp::connection_hdl hdl, M msg, Session &session) {
+    Encoding encoding;
+    {
+        std::lock_guard lock(sessionsMutex);
+        encoding = session.encoding;
+    }
 
     auto sendError = [](const std::string &message, const std::string &what) {
         Json json;
@@ -22,7 +230,13 @@ void messageHandler(S &&send, F &&callback, websocketpp::connection_hdl hdl, M m
     Json json;
     Json result;
 
-    auto formResponse = [&result](Json const &r) {
+    // команды, посчитанные в пуле потоков, отвечают отдельным сообщением;
+    // ответ приходит уже текстом и только оборачивается в массив
+    auto reply = [send](std::string const &r) {
+        send("[" + r + "]");
+    };
+
+    auto formResponse = [&result, &route](Json const &r) {
         if (r.empty()) {
             return;
         }
@@ -35,22 +249,66 @@ void messageHandler(S &&send, F &&callback, websocketpp::connection_hdl hdl, M m
 
         if (r.is_array()) {
             for (auto const &e: r) {
-                result.push_back(e);
+                if (!route(e)) {
+                    result.push_back(e);
+                }
             }
-        } else {
-
+        } else if (!route(r)) {
             result.push_back(r);
         }
     };
 
+    // transmit_data в текстовом кадре разбирается сразу из текста, без дерева Json
+    if (msg->get_opcode() != websocketpp::frame::opcode::binary) {
+        try {
+            if (auto r = callback(std::string_view(msg->get_payload()))) {
+                LOG_PAYLOAD(Debug, "Accepted: " << msg->get_payload());
+                formResponse(*r);
+                return send(result);
+            }
+        } catch (std::exception &e) {
+            return send(Json::array({sendError("undefined request error", e.what())}));
+        }
+    }
+
     try {
-        json = Json::parse(msg->get_payload());
+        json = decode(msg->get_payload(), msg->get_opcode() == websocketpp::frame::opcode::binary,
+                encoding);
     } catch (std::exception &e) {
         return send(sendError("parse error", e.what()));
     }
 
+    // hello выбирает кодировку соединения; ответ на него уходит ещё в прежней
+    std::optional<Encoding> negotiated;
+    auto dispatch = [&](Json const &j) {
+        if (j.contains("command_name") && j["command_name"] == "hello") {
+            auto name = j.value("encoding", std::string("json"));
+            negotiated = parseEncoding(name);
+            if (!negotiated) {
+                throw std::runtime_error("unknown encoding '" + name + "'");
+            }
+            Json r;
+            r["command_name"] = "hello";
+            r["encoding"] = name;
+            return r;
+        }
+        if (j.contains("command_name") && (j["command_name"] == "attach" ||
+                j["command_name"] == "detach")) {
+            std::lock_guard lock(sessionsMutex);
+            return attach(hdl, session, j, j["command_name"] == "detach");
+        }
+        // подписка принадлежит соединению, через которое пришла
+        if (j.contains("command_name") && (j["command_name"] == "subscribe" ||
+                j["command_name"] == "unsubscribe")) {
+            Json request = j;
+            request["subscriber"] = session.id;
+            return callback(request, reply);
+        }
+        return callback(j, reply, drain);
+    };
+
     try {
-	std::cout << "Accepted: " + json.dump() << std::endl;
+        LOG_PAYLOAD(Debug, "Accepted: " << json.dump());
         if (json.is_array()) {
             for (auto &j: json) {
                 if (json.contains("command_name")) {
@@ -59,10 +317,10 @@ void messageHandler(S &&send, F &&callback, websocketpp::connection_hdl hdl, M m
                         throw std::runtime_error("saving and stopping...");
                     }
                 }
-                formResponse(callback(j));
+                formResponse(dispatch(j));
             }
         } else {
-            formResponse(callback(json));
+            formResponse(dispatch(json));
         }
     } catch (std::exception &e) {
         if (e.what() == std::string("stop")) {
@@ -75,77 +333,541 @@ void messageHandler(S &&send, F &&callback, websocketpp::connection_hdl hdl, M m
     if (!result.empty()) {
         send(result);
     }
+    if (negotiated) {
+        std::lock_guard lock(sessionsMutex);
+        session.encoding = *negotiated;
+    }
 }
 
-std::function<void()> timerf;
-
 boost::asio::io_service io_service;
-boost::posix_time::seconds interval(5 * 60);
-boost::asio::deadline_timer asioTimer(io_service, interval);
 
-void tick(const boost::system::error_code&)
-{
-    timerf();
-    asioTimer.expires_at(asioTimer.expires_at() + interval);
-    asioTimer.async_wait(tick);
+// пока в очереди отправки больше половины highWater, чтение остаётся приостановленным
+template<typename S>
+void waitDrain(S &s, websocketpp::connection_hdl hdl,
+        std::shared_ptr<boost::asio::steady_timer> timer) {
+    timer->expires_from_now(std::chrono::milliseconds(10));
+    timer->async_wait([&s, hdl, timer](auto const &error) {
+        if (error) {
+            return;
+        }
+        websocketpp::lib::error_code ec;
+        auto con = s.get_con_from_hdl(hdl, ec);
+        if (ec) {
+            return;
+        }
+        if (con->get_buffered_amount() > connectionSettings.highWater / 2) {
+            return waitDrain(s, hdl, timer);
+        }
+        {
+            std::lock_guard lock(sessionsMutex);
+            auto session = sessions.find(hdl);
+            if (session == sessions.end()) {
+                return;
+            }
+            session->second.paused = false;
+        }
+        LOG(Debug, "Resuming reads");
+        con->resume_reading();
+    });
+}
+
+// вызывает next на потоке событий, когда очередь отправки соединения уменьшится
+// до streamWindow байт; если соединение закрылось, next не вызывается
+template<typename S>
+void whenDrained(S &s, websocketpp::connection_hdl hdl, std::function<void()> next,
+        std::shared_ptr<boost::asio::steady_timer> timer = {}) {
+    websocketpp::lib::error_code ec;
+    auto con = s.get_con_from_hdl(hdl, ec);
+    if (ec) {
+        return;
+    }
+    std::size_t buffered = con->get_buffered_amount();
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto session = sessions.find(hdl);
+        if (session == sessions.end()) {
+            return;
+        }
+        buffered += session->second.pending.items.size();
+    }
+    if (buffered <= connectionSettings.streamWindow) {
+        return next();
+    }
+
+    if (!timer) {
+        timer = std::make_shared<boost::asio::steady_timer>(io_service);
+    }
+    timer->expires_from_now(std::chrono::milliseconds(10));
+    timer->async_wait([&s, hdl, next = std::move(next), timer](auto const &error) mutable {
+        if (!error) {
+            whenDrained(s, hdl, std::move(next), std::move(timer));
+        }
+    });
+}
+
+// если другая сторона не успевает забирать данные, новые сообщения от неё не читаются:
+// иначе очередь отправки растёт без ограничения
+template<typename S>
+void throttle(S &s, websocketpp::connection_hdl hdl) {
+    websocketpp::lib::error_code ec;
+    auto con = s.get_con_from_hdl(hdl, ec);
+    if (ec) {
+        return;
+    }
+    auto buffered = con->get_buffered_amount();
+    if (buffered <= connectionSettings.highWater) {
+        return;
+    }
+    std::shared_ptr<boost::asio::steady_timer> timer;
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto session = sessions.find(hdl);
+        if (session == sessions.end() || session->second.paused) {
+            return;
+        }
+        session->second.paused = true;
+        if (!session->second.drainTimer) {
+            session->second.drainTimer = std::make_shared<boost::asio::steady_timer>(io_service);
+        }
+        timer = session->second.drainTimer;
+    }
+    LOG(Debug, "Pausing reads, " << buffered << " bytes are waiting to be sent");
+    con->pause_reading();
+    waitDrain(s, hdl, timer);
+}
+
+template<typename S>
+void sendFrame(S &s, websocketpp::connection_hdl hdl, std::string const &payload,
+        Encoding encoding) {
+    websocketpp::lib::error_code ec;
+    if (isBinary(encoding)) {
+        LOG_PAYLOAD(Debug, "Sending :" << encodingName(encoding) << " message, "
+                << payload.size() << " bytes");
+        s.send(hdl, payload, websocketpp::frame::opcode::binary, ec);
+    } else {
+        LOG_PAYLOAD(Debug, "Sending :" << payload);
+        s.send(hdl, payload, websocketpp::frame::opcode::text, ec);
+    }
+    if (ec) {
+        LOG(Warning, "send failed: " << ec.message());
+        return;
+    }
+    if (connectionSettings.highWater != 0) {
+        throttle(s, hdl);
+    }
+}
+
+// отправляет накопленные для соединения ответы
+template<typename S>
+void flush(S &s, websocketpp::connection_hdl hdl) {
+    std::string payload;
+    Encoding encoding;
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto session = sessions.find(hdl);
+        if (session == sessions.end()) {
+            return;
+        }
+        auto &pending = session->second.pending;
+        session->second.flushScheduled = false;
+        if (pending.empty()) {
+            return;
+        }
+        encoding = pending.encoding;
+        payload = pending.take();
+    }
+    sendFrame(s, hdl, payload, encoding);
+}
+
+// сообщение соединению hdl в его кодировке; закрытые соединения пропускаются.
+// Массивы (ответы на команды) копятся и уходят одним кадром по правилам coalesceMs и
+// coalesceBytes; одиночный объект сначала выталкивает накопленное и уходит сам
+template<typename S, typename Message>
+void sendTo(S &s, websocketpp::connection_hdl hdl, Message const &message) {
+    bool single;
+    if constexpr (std::is_same_v<Message, Json>) {
+        if (message.empty()) {
+            return;
+        }
+        single = !message.is_array();
+    } else {
+        single = message.empty() || message.front() != '[';
+    }
+
+    Encoding encoding;
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto session = sessions.find(hdl);
+        if (session == sessions.end()) {
+            return;
+        }
+        encoding = session->second.encoding;
+    }
+
+    // кодирование - вне блокировки, под ней только склеиваются готовые строки
+    std::string payload;
+    Batch part;
+    part.encoding = encoding;
+    if (single) {
+        payload = encode(message, encoding);
+    } else if constexpr (std::is_same_v<Message, Json>) {
+        for (auto const &e: message) {
+            part.add(e);
+        }
+    } else {
+        part.addText(message);
+    }
+
+    std::vector<std::pair<std::string, Encoding>> frames;
+    std::shared_ptr<boost::asio::steady_timer> timer;
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto session = sessions.find(hdl);
+        if (session == sessions.end()) {
+            return;
+        }
+        auto &pending = session->second.pending;
+        // после hello накопленное в прежней кодировке уходит отдельно
+        if (!pending.empty() && (single || pending.encoding != encoding)) {
+            frames.emplace_back(pending.take(), pending.encoding);
+        }
+        if (single) {
+            frames.emplace_back(std::move(payload), encoding);
+        } else {
+            pending.encoding = encoding;
+            pending.merge(std::move(part));
+            if (connectionSettings.coalesceMs <= 0 ||
+                    pending.items.size() >= connectionSettings.coalesceBytes) {
+                if (!pending.empty()) {
+                    frames.emplace_back(pending.take(), encoding);
+                }
+            } else if (!session->second.flushScheduled && !pending.empty()) {
+                session->second.flushScheduled = true;
+                if (!session->second.flushTimer) {
+                    session->second.flushTimer =
+                            std::make_shared<boost::asio::steady_timer>(io_service);
+                }
+                timer = session->second.flushTimer;
+            }
+        }
+    }
+
+    for (auto const &[frame, frameEncoding]: frames) {
+        sendFrame(s, hdl, frame, frameEncoding);
+    }
+    if (timer) {
+        timer->expires_from_now(std::chrono::milliseconds(connectionSettings.coalesceMs));
+        timer->async_wait([&s, hdl, timer](auto const &error) {
+            if (!error) {
+                flush(s, hdl);
+            }
+        });
+    }
+}
+
+// уведомление подписки - соединению, которое на неё подписалось
+template<typename S>
+void notifySubscriber(S &s, Json const &notice) {
+    websocketpp::connection_hdl hdl;
+    {
+        std::lock_guard lock(sessionsMutex);
+        auto it = sessionIds.find(notice.value("subscriber", std::uint64_t(0)));
+        if (it == sessionIds.end()) {
+            return;
+        }
+        hdl = it->second;
+    }
+    Json message = notice;
+    message.erase("subscriber");
+    sendTo(s, hdl, Json::array({std::move(message)}));
+}
+
+// уведомления в ответе команды, выполненной не по запросу соединения
+template<typename S>
+void notifySubscribers(S &s, Json const &r) {
+    if (!r.is_array()) {
+        return;
+    }
+    for (auto const &e: r) {
+        if (e.value("command_name", std::string()) == "notify") {
+            notifySubscriber(s, e);
+        }
+    }
+}
+
+boost::asio::steady_timer notifyTimer(io_service);
+
+// callback() без аргументов возвращает задержанные интервалом уведомления подписок
+template<typename S, typename F>
+void pollNotices(S &s, F &msgCall) {
+    notifySubscribers(s, msgCall());
+    notifyTimer.expires_from_now(std::chrono::milliseconds(connectionSettings.notifyMs));
+    notifyTimer.async_wait([&s, &msgCall](auto const &ec) {
+        if (!ec) {
+            pollNotices(s, msgCall);
+        }
+    });
+}
+
+boost::asio::deadline_timer idleTimer(io_service);
+
+// закрывает соединения, от которых не было сообщений дольше idleSeconds
+template<typename S>
+void checkIdle(S &s) {
+    auto idleSeconds = connectionSettings.idleSeconds;
+    auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(idleSeconds);
+    std::vector<websocketpp::connection_hdl> idle;
+    {
+        std::lock_guard lock(sessionsMutex);
+        for (auto const &[hdl, session]: sessions) {
+            if (session.lastActive < deadline) {
+                idle.push_back(hdl);
+            }
+        }
+    }
+    for (auto const &hdl: idle) {
+        LOG(Info, "Closing idle connection");
+        websocketpp::lib::error_code ec;
+        s.close(hdl, websocketpp::close::status::going_away, "idle timeout", ec);
+    }
+    idleTimer.expires_from_now(boost::posix_time::seconds(std::max(idleSeconds / 2, 1)));
+    idleTimer.async_wait([&s](auto const &ec) {
+        if (!ec) {
+            checkIdle(s);
+        }
+    });
 }
 
-template<typename S, typename F, typename C, typename T>
-void setup(S &s, C &&cntCall, F &&msgCall, websocketpp::connection_hdl &connection, T && timer) {
-    s.set_access_channels(websocketpp::log::alevel::all);
-    s.clear_access_channels(websocketpp::log::alevel::frame_payload);
+template<typename S, typename F, typename C>
+void setup(S &s, C &&cntCall, F &&msgCall, ConnectionSettings settings) {
+    // заголовки каждого кадра websocketpp выводит синхронно, поэтому только при отладке
+    if (Log::enabled(Log::Level::Debug)) {
+        s.set_access_channels(websocketpp::log::alevel::all);
+        s.clear_access_channels(websocketpp::log::alevel::frame_payload);
+    } else {
+        s.clear_access_channels(websocketpp::log::alevel::all);
+        s.set_access_channels(websocketpp::log::alevel::connect |
+                websocketpp::log::alevel::disconnect | websocketpp::log::alevel::fail);
+    }
 
-    timerf = timer;
-    asioTimer.async_wait(tick);
+    connectionSettings = settings;
     s.init_asio(&io_service);
 
-    s.set_open_handler([&connection, &cntCall, &s](auto hdl) {
-        std::cout << "Connected to server" << std::endl;
-        connection = hdl;
-        auto msg = cntCall();
-        if (!msg.empty()) {
-            s.send(connection, cntCall().dump(), websocketpp::frame::opcode::text);
+    if (settings.idleSeconds > 0) {
+        checkIdle(s);
+    }
+
+    // подписки есть, только если обработчик умеет отдавать уведомления
+    if constexpr (std::is_invocable_v<F &>) {
+        if (settings.notifyMs > 0) {
+            pollNotices(s, msgCall);
+        }
+    }
+
+    // подпротокол cbor или msgpack сразу выбирает двоичную кодировку соединения
+    s.set_validate_handler([&s](auto hdl) {
+        auto con = s.get_con_from_hdl(hdl);
+        auto maxConnections = connectionSettings.maxConnections;
+        std::unique_lock lock(sessionsMutex);
+        if (maxConnections != 0 && sessions.size() >= maxConnections) {
+            LOG(Warning, "Connection refused: limit of " << maxConnections << " reached");
+            con->set_status(websocketpp::http::status_code::service_unavailable);
+            return false;
+        }
+        lock.unlock();
+        for (auto const &p: con->get_requested_subprotocols()) {
+            if (parseEncoding(p)) {
+                con->select_subprotocol(p);
+                break;
+            }
+        }
+        return true;
+    });
+
+    s.set_open_handler([&cntCall, &s](auto hdl) {
+        LOG(Info, "Connected to server");
+        auto encoding = parseEncoding(s.get_con_from_hdl(hdl)->get_subprotocol());
+        {
+            std::lock_guard lock(sessionsMutex);
+            auto &session = sessions[hdl];
+            session.encoding = encoding.value_or(Encoding::Json);
+            session.id = ++lastSessionId;
+            sessionIds[session.id] = hdl;
+        }
+        sendTo(s, hdl, cntCall());
+    });
+
+    s.set_close_handler([&s, &msgCall](auto hdl) {
+        std::unique_lock lock(sessionsMutex);
+        auto it = sessions.find(hdl);
+        if (it == sessions.end()) {
+            return;
+        }
+        auto id = it->second.id;
+        sessionIds.erase(id);
+        for (auto device: it->second.devices) {
+            owners.erase(device);
+        }
+        // ожидающие обработчики таймеров держат их сами и увидят, что сессии уже нет
+        for (auto const &t: {it->second.flushTimer, it->second.drainTimer}) {
+            if (t) {
+                t->cancel();
+            }
+        }
+        sessions.erase(it);
+        lock.unlock();
+
+        if constexpr (std::is_invocable_v<F &>) {
+            Json request;
+            request["command_name"] = "unsubscribe";
+            request["subscriber"] = id;
+            request["all"] = true;
+            notifySubscribers(s, msgCall(request));
         }
     });
 
     s.set_message_handler(
             [&](auto &&hdl, auto &&msg) {
-                messageHandler([&](Json const &json) {
-		    std::cout << "Sending :" + json.dump() << std::endl;
-                    if (json.empty()) {
+                Session *session;
+                {
+                    std::lock_guard lock(sessionsMutex);
+                    auto it = sessions.find(hdl);
+                    if (it == sessions.end()) {
                         return;
                     }
-                    s.send(connection, json.dump(), websocketpp::frame::opcode::text);
-                }, msgCall, hdl, msg);
+                    session = &it->second;
+                    session->lastActive = std::chrono::steady_clock::now();
+                }
+
+                // команды устройствам, подключённым через другие соединения, копятся
+                // в их очередях и уходят одним сообщением после разбора
+                std::vector<websocketpp::connection_hdl> touched;
+                auto route = [&](Json const &e) {
+                    auto command = e.value("command_name", std::string());
+                    if (command == "notify") {
+                        notifySubscriber(s, e);
+                        return true;
+                    }
+                    if ((command != "transmit_data" && command != "transmit_batch") ||
+                            !e.contains("data") || !e.contains("device_id")) {
+                        return false;
+                    }
+                    auto device = e["device_id"].get<Device>();
+                    std::lock_guard lock(sessionsMutex);
+                    auto owner = ownerSession(device, hdl);
+                    if (owner == nullptr) {
+                        return false;
+                    }
+                    if (owner->outbox.empty()) {
+                        touched.push_back(owners[device]);
+                    }
+                    owner->outbox.push_back(e);
+                    return true;
+                };
+
+                messageHandler([&s, hdl](auto const &message) { sendTo(s, hdl, message); },
+                        route, msgCall,
+                        [&s, hdl](std::function<void()> next) {
+                            whenDrained(s, hdl, std::move(next));
+                        },
+                        hdl, msg, *session);
+
+                for (auto const &t: touched) {
+                    std::unique_lock lock(sessionsMutex);
+                    auto owner = sessions.find(t);
+                    if (owner != sessions.end()) {
+                        Json batch(std::move(owner->second.outbox));
+                        owner->second.outbox.clear();
+                        lock.unlock();
+                        sendTo(s, t, batch);
+                    }
+                }
             }
     );
 }
 
-template<typename F, typename C, typename T>
-void runServer(C &&cntCall, F &&msgCall, int port, T && timer) {
-    websocketpp::connection_hdl connection;
-    using Server = websocketpp::server<websocketpp::config::asio>;
+// выполняет обработчики в threads потоках; исключение в любом из них (команда stop)
+// останавливает все потоки и передаётся дальше
+template<typename S>
+void runThreads(S &s, unsigned threads) {
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto run = [&]() {
+        try {
+            s.run();
+        }
+        catch (...) {
+            std::lock_guard lock(errorMutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            s.stop();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back(run);
+    }
+    run();
+    for (auto &w: workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template<typename Server, typename F, typename C>
+void serve(C &&cntCall, F &&msgCall, int port, ConnectionSettings settings, unsigned threads) {
     Server server;
-    setup(server, cntCall, msgCall, connection, timer);
+    setup(server, cntCall, msgCall, settings);
     server.listen(port);
     server.start_accept();
-    server.run();
+    runThreads(server, threads);
 }
 
-template<typename F, typename C, typename T>
-void runClient(C &&cntCall, F &&msgCall, std::string const &uri, T && timer) {
-    websocketpp::connection_hdl connection;
-    using Client = websocketpp::client<websocketpp::config::asio_client>;
+template<typename F, typename C>
+void runServer(C &&cntCall, F &&msgCall, int port, ConnectionSettings settings = {},
+        unsigned threads = 1) {
+    if (settings.deflate) {
+        using Server = websocketpp::server<DeflateConfig<websocketpp::config::asio>>;
+        serve<Server>(cntCall, msgCall, port, settings, threads);
+    } else {
+        using Server = websocketpp::server<websocketpp::config::asio>;
+        serve<Server>(cntCall, msgCall, port, settings, threads);
+    }
+}
+
+template<typename Client, typename F, typename C>
+void connectClient(C &&cntCall, F &&msgCall, std::string const &uri, std::string const &encoding,
+        ConnectionSettings settings, unsigned threads) {
     Client client;
-    setup(client, cntCall, msgCall, connection, timer);
+    setup(client, cntCall, msgCall, settings);
 
     websocketpp::lib::error_code ec;
-    Client::connection_ptr con = client.get_connection(uri, ec);
+    typename Client::connection_ptr con = client.get_connection(uri, ec);
     if (ec) {
-        std::cout << "could not create connection because: " << ec.message() << std::endl;
+        LOG(Error, "could not create connection because: " << ec.message());
         return;
     }
 
+    if (!encoding.empty()) {
+        con->add_subprotocol(encoding);
+    }
     client.connect(con);
-    client.run();
+    runThreads(client, threads);
+}
+
+// encoding - подпротокол с кодировкой, которую клиент предлагает серверу
+template<typename F, typename C>
+void runClient(C &&cntCall, F &&msgCall, std::string const &uri, std::string const &encoding = {},
+        ConnectionSettings settings = {}, unsigned threads = 1) {
+    if (settings.deflate) {
+        using Client = websocketpp::client<DeflateConfig<websocketpp::config::asio_client>>;
+        connectClient<Client>(cntCall, msgCall, uri, encoding, settings, threads);
+    } else {
+        using Client = websocketpp::client<websocketpp::config::asio_client>;
+        connectClient<Client>(cntCall, msgCall, uri, encoding, settings, threads);
+    }
 }